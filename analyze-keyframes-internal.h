@@ -0,0 +1,21 @@
+/*
+ * analyze-keyframes-internal.h
+ *
+ *  Copyright:
+ *    Jon Honeycutt   (2019) <jhoneycutt@gmail.com>
+ *
+ *  License:
+ *    BSD 3-clause; see LICENSE.
+ */
+
+// State that libanalyzekeyframes shares with its own test program, and that isn't part of its interface.
+
+#pragma once
+
+#include <cstdint>
+
+// A program that replaces the global operator new can count the calls to it that a thread makes while that thread's
+// countsAllocations is set, which lets runSelfTests() check that keyframes are analyzed without allocating memory.
+// analyze-keyframes_test does, by linking self-test-allocations.cpp; in programs that don't, the check is skipped.
+extern thread_local bool countsAllocations;
+extern thread_local uint64_t allocationCount;
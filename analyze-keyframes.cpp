@@ -12,343 +12,3919 @@
  */
 
 #include "analyze-keyframes.h"
+#include "analyze-keyframes-internal.h"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
 #include <cinttypes>
+#include <cmath>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
-static const unsigned VerticalCellCount = 3;
-static const unsigned HorizontalCellCount = 3;
-static const char* FrameAnalysisCSVFile = "frame-analysis.csv";
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// Outputs each keyframe as an 8bpp grayscale bitmap, named like frame-0.pgm. To convert them to JPEG, you can use
-// mogrify from ImageMagick, like: mogrify -format jpeg *.pgm
-static const bool OutputKeyframeImages = false;
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_HISTOGRAM_KERNELS 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON_HISTOGRAM_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+// The scaling algorithm used when converting frames without a luma plane to GRAY8. The output is the same size as the
+// input, so the cheapest algorithm gives the same result as the more expensive ones.
+static const int GrayscaleConversionFlags = SWS_POINT;
+
+// The maximum number of GRAY8 frames that GrayscaleConverter keeps around for reuse.
+static const size_t GrayscaleFramePoolSize = 4;
+
+// When seeking between keyframes using the container's index, keyframes that are closer than this many bytes to the
+// current read position are reached by reading forward instead, since that's cheaper than a seek.
+static const int64_t KeyframeSeekThreshold = 4 * 1024 * 1024;
+
+// The limits on how much of the input avformat_find_stream_info reads, in bytes and in AV_TIME_BASE units, with
+// --fast-probe. These are enough for the stream parameters of typical files, where FFmpeg's defaults are 5 MB and 5 s.
+static const int64_t FastProbeSize = 512 * 1024;
+static const int64_t FastProbeAnalyzeDuration = AV_TIME_BASE / 2;
+
+// Part of the key of every cached analysis. Change it whenever the output for the same input and options changes, so
+// that stale results aren't reused.
+static const char* ResultCacheVersion = "analyze-keyframes results 2";
+
+// The number of bytes from the start and end of each input file that are hashed into its cache key.
+static const size_t ResultCacheHashedSize = 64 * 1024;
+
+// The coarse luma median used by --coarse-duplicate-threshold is computed from every CoarseSampleStride-th pixel of
+// every CoarseSampleStride-th row.
+static const int CoarseSampleStride = 8;
+
+// FrameAnalysisWriter writes its buffered rows to disk once they reach this many bytes.
+static const size_t FrameAnalysisBufferSize = 1024 * 1024;
+
+// The alignment of the planes of pooled frame buffers, which is at least what any of libavcodec's SIMD code needs.
+static const int FrameBufferAlignment = 64;
 
 using std::array;
-using std::endl;
-using std::ios;
-using std::ofstream;
+using std::string;
 using std::vector;
 
-static void logging(const char* format, ...);
-static bool processPacket(const AVPacket*, AVCodecContext*, const AVRational& timeBase);
-static bool outputGrayscaleFrame(AVFrame*, const char* filename);
-static bool analyzeGrayscaleFrame(AVFrame*, const AVRational& timeBase);
-static bool processKeyframe(AVCodecContext*, AVFrame*, const AVRational& timeBase);
+// How far the cell medians computed from downscaled keyframes are from those of the full-resolution keyframes.
+struct SamplingError {
+    uint64_t cellCount { 0 };
+    double totalError { 0 };
+    float maximumError { 0 };
+
+    void add(const CellMedians& exactMedians, const CellMedians& sampledMedians)
+    {
+        for (size_t i = 0; i < exactMedians.size(); ++i) {
+            float error = std::abs(exactMedians[i] - sampledMedians[i]);
+            totalError += error;
+            maximumError = std::max(maximumError, error);
+        }
+        cellCount += exactMedians.size();
+    }
+
+    void add(const SamplingError& other)
+    {
+        cellCount += other.cellCount;
+        totalError += other.totalError;
+        maximumError = std::max(maximumError, other.maximumError);
+    }
+};
+
+// Finds the near-duplicate keyframes to suppress; see AnalyzerOptions::duplicateThreshold. isDuplicate() compares
+// keyframes' medians in output order, and isCoarseDuplicate() compares decoded keyframes, before they're analyzed, in
+// decode order, so each is only called from one thread at a time.
+struct DuplicateFilter {
+    bool isDuplicate(const CellMedians&, const AnalyzerOptions&);
+    bool isCoarseDuplicate(const AVFrame*, const AnalyzerOptions&);
+
+    // The medians of the last keyframe that wasn't a duplicate, and the coarse median of the last one analyzed.
+    CellMedians lastMedians;
+    float lastCoarseMedian { -1 };
+    uint64_t duplicateCount { 0 };
+    uint64_t coarseDuplicateCount { 0 };
+};
+
+// The state kept across keyframes, and by an Analyzer across files, by each thread that analyzes them.
+struct AnalysisState {
+    GrayscaleConverter grayscaleConverter;
+    SamplingError samplingError;
+    // The histograms of one band of cells, for analysis straight from a luma plane with a sample stride, or at more
+    // than 8 bits per sample.
+    vector<uint32_t> stridedHistograms;
+    // The full range 8-bit luma of each code value of the keyframe being analyzed; see eightBitLumaValues().
+    vector<float> lumaValues;
+    // Prepended to the names of the input's keyframe images; see Analyzer::analyzeToFile().
+    string keyframeImagePrefix;
+};
+
+// The buffers that an Analyzer's decoders decode into while its threads are pinned to CPUs; see getPooledFrameBuffer().
+// libavcodec's own pools belong to each codec context, so they're freed after each input, and their buffers allocated
+// again for the next. These are kept as long as the codec and the frame format and size don't change, so a batch
+// worker's frames are allocated, and first touched, once, by threads on its CPUs, which keeps them in memory local to
+// those CPUs. The codec is part of the key because the padding and alignment each decoder needs depend on it. Frame
+// threads allocate frames concurrently, so the pools are only used under the lock.
+class FrameBufferPool {
+public:
+    ~FrameBufferPool();
+
+    // Fills in the frame's buffers, or returns false, leaving them unset, if the frame isn't one the pool allocates.
+    bool allocate(AVCodecContext*, AVFrame*);
+
+private:
+    bool configure(AVCodecContext*, AVPixelFormat, int width, int height);
+    void release();
+
+    std::mutex m_mutex;
+    AVCodecID m_codecID { AV_CODEC_ID_NONE };
+    AVPixelFormat m_format { AV_PIX_FMT_NONE };
+    int m_width { 0 };
+    int m_height { 0 };
+    int m_linesizes[4] { };
+    AVBufferPool* m_pools[4] { };
+};
+
+// The state used while processing the keyframes of the analyzed video stream. The analysis states are the Analyzer's:
+// the first is used when analyzing on one thread, and collects the sampling error, and the rest by each of the
+// pipeline's analysis threads.
+struct StreamAnalysis {
+    const AnalyzerOptions* options;
+    AVCodecContext* codecContext;
+    AnalysisState* analysisStates;
+    const Analyzer::KeyframeHandler* handleKeyframe;
+    DuplicateFilter duplicateFilter;
+    // The analysis of the keyframe being processed when analyzing on one thread. It's reused for every keyframe, so
+    // that its medians aren't reallocated each time.
+    KeyframeAnalysis keyframe;
+};
+
+// A decoded keyframe on its way through the analysis pipeline, and the result of analyzing it. Keyframes are numbered
+// in the order they're decoded, so that their results can be written in that order.
+// decodedTime is only set when statistics are being collected.
+struct KeyframeWork {
+    uint64_t sequenceNumber;
+    int keyframeNumber;
+    AVFramePtr frame;
+    PerformanceStatistics::Clock::time_point decodedTime;
+};
+
+struct KeyframeResult {
+    uint64_t sequenceNumber;
+    KeyframeAnalysis analysis;
+    PerformanceStatistics::Clock::time_point decodedTime;
+};
+
+// A keyframe of the analyzed stream, as listed in the container's index.
+struct KeyframeIndexEntry {
+    int64_t position;
+    int64_t timestamp;
+};
+
+// The statistics being collected, or null if they aren't; see setPerformanceStatistics().
+static PerformanceStatistics* performanceStatistics;
+
+// Times the enclosing scope as the given stage, if statistics are being collected.
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage)
+        : m_stage(stage)
+    {
+        if (performanceStatistics)
+            m_start = PerformanceStatistics::Clock::now();
+    }
+
+    ~StageTimer()
+    {
+        if (performanceStatistics)
+            performanceStatistics->addStageTime(m_stage, PerformanceStatistics::Clock::now() - m_start);
+    }
+
+private:
+    Stage m_stage;
+    PerformanceStatistics::Clock::time_point m_start;
+};
+
+// Pins the calling thread to a set of CPUs for as long as it's in scope. The threads it starts in the meantime, like
+// the decoder's and the pipeline's, inherit the set. Pinning is only supported on Linux; elsewhere, or if none of the
+// CPUs can be used, threads run wherever the scheduler puts them.
+class ScopedThreadAffinity {
+public:
+    explicit ScopedThreadAffinity(const vector<unsigned>& cpus);
+    ~ScopedThreadAffinity();
+
+private:
+#if defined(__linux__)
+    cpu_set_t m_previousCPUs;
+    bool m_isPinned { false };
+#endif
+};
+
+// Messages are only logged if they're at or below the current log level.
+static LogLevel logLevel = LogLevel::Info;
+
+// The exporter that writes keyframe images, or null if they aren't being output.
+static ImageExporter* imageExporter;
+
+// The logger that writes log lines, or null to write them directly to stderr.
+static AsyncLogger* asyncLogger;
+
+thread_local bool countsAllocations;
+thread_local uint64_t allocationCount;
+
+static vector<KeyframeIndexEntry> keyframeIndex(AVStream*);
+static bool restrictToShard(AVFormatContext*, int videoStreamIndex, const AnalyzerOptions&, int64_t& startTimestamp, int64_t& endTimestamp);
+template<typename PacketHandler> static bool demuxKeyframePackets(AVFormatContext*, int videoStreamIndex, const AnalyzerOptions&, const ResumePoint&, PacketHandler);
+template<typename FrameHandler> static bool decodePacket(const AVPacket*, AVCodecContext*, AVFrame*, FrameHandler);
+static bool analyzeStreamPipelined(AVFormatContext*, int videoStreamIndex, StreamAnalysis&, const AnalyzerOptions&, const ResumePoint&);
+static string outputOptionsKey(const AnalyzerOptions&);
+static uint64_t keyHash(const string& key);
+static string resumeKey(const AnalyzerOptions&);
+static bool resultCacheEntry(const char* inputFile, const AnalyzerOptions&, string& entry);
+static bool copyFile(const string& source, const string& destination);
+static bool writeFile(const string& filename, const string& contents);
+static bool writeContents(int fileDescriptor, const string& contents);
+static bool readFile(const string& filename, string& contents);
+static bool parseCSVRow(const string& contents, size_t rowStart, double& seconds, size_t& columnCount);
+static bool analyzeGrayscaleFrame(const AVFrame*, const Grid&, const float* lumaValues, float* cellMedians);
+static bool analyzeGrayscaleFrameWithGrids(const AVFrame*, const vector<Grid>&, const float* lumaValues, float* cellMedians);
+static bool analyzeKeyframe(const AVFrame*, int keyframeNumber, const AnalyzerOptions&, AnalysisState&, CellMedians&);
+static bool analyzeEightBitKeyframe(const AVFrame*, int keyframeNumber, const AnalyzerOptions&, AnalysisState&, CellMedians&);
+static bool processKeyframe(StreamAnalysis&, AVFrame*);
+static bool emitKeyframe(StreamAnalysis&, KeyframeAnalysis&, PerformanceStatistics::Clock::time_point decodedTime);
+static bool setUpHardwareDecoding(AVCodecContext*, const AVCodec*, const char* deviceTypeName, AVPixelFormat& hardwarePixelFormat);
+static int getPooledFrameBuffer(AVCodecContext*, AVFrame*, int flags);
+static bool hasDirectLumaPlane(AVPixelFormat);
+static bool hasHighBitDepthLumaPlane(AVPixelFormat);
+static unsigned lumaBitDepth(AVPixelFormat);
+static bool exportKeyframeImage(const AVFrame*, int keyframeNumber, const AnalyzerOptions&, AnalysisState&, const AVFrame* convertedFrame = nullptr);
+static void cellBoundaries(unsigned length, unsigned count, vector<unsigned>& boundaries);
+static float histogramMedian(const uint32_t* histogram, unsigned count, const float* values = nullptr);
 static const char* AVError(int errorCode);
 
-int main(int argc, const char* argv[])
+// Cached analyses are named after a hash of the input file's size, modification time, and first and last
+// ResultCacheHashedSize bytes, and of the options that affect the output. Only regular files can be cached.
+static bool resultCacheEntry(const char* inputFile, const AnalyzerOptions& options, string& entry)
 {
-    if (argc < 2) {
-        logging("Usage: %s <video file>", argv[0]);
-        return -1;
+    int fileDescriptor = ::open(inputFile, O_RDONLY);
+    if (fileDescriptor == -1)
+        return false;
+
+    struct stat fileStatus;
+    if (fstat(fileDescriptor, &fileStatus) || !S_ISREG(fileStatus.st_mode)) {
+        close(fileDescriptor);
+        return false;
+    }
+
+    string key = ResultCacheVersion;
+    key += "\nsize " + std::to_string(fileStatus.st_size) + " mtime " + std::to_string(fileStatus.st_mtime) + "\n";
+    vector<char> contents(ResultCacheHashedSize);
+    ssize_t length = pread(fileDescriptor, contents.data(), contents.size(), 0);
+    if (length > 0)
+        key.append(contents.data(), length);
+    if (fileStatus.st_size > static_cast<off_t>(ResultCacheHashedSize)) {
+        length = pread(fileDescriptor, contents.data(), contents.size(), fileStatus.st_size - ResultCacheHashedSize);
+        if (length > 0)
+            key.append(contents.data(), length);
+    }
+    close(fileDescriptor);
+    key += outputOptionsKey(options);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64, keyHash(key));
+    entry = options.cacheDirectory + string(name) + (options.outputFormat == FrameAnalysisFormat::Binary ? ".kfa" : ".csv");
+    return true;
+}
+
+// The options that affect the output, as they're keyed in cached analyses and resumable output files.
+static string outputOptionsKey(const AnalyzerOptions& options)
+{
+    string key;
+    for (auto& grid : options.grids)
+        key += "\ngrid " + std::to_string(grid.columns) + "x" + std::to_string(grid.rows);
+    key += "\nformat " + std::to_string(static_cast<int>(options.outputFormat));
+    key += "\nsampling " + std::to_string(options.sampleStride) + " " + std::to_string(options.analysisWidth) + "x" + std::to_string(options.analysisHeight);
+    key += "\nrange " + std::to_string(options.startTime) + " " + std::to_string(options.endTime) + " " + std::to_string(options.maximumKeyframeCount);
+    key += "\nshard " + std::to_string(options.shardIndex) + "/" + std::to_string(options.shardCount);
+    key += "\nstream " + std::to_string(options.streamIndex);
+    key += "\nluma " + std::to_string(static_cast<int>(options.lumaScale)) + " " + std::to_string(static_cast<int>(options.lumaRange));
+    key += "\nduplicates " + std::to_string(options.duplicateThreshold) + " " + std::to_string(static_cast<int>(options.duplicateMetric)) + " "
+        + std::to_string(options.markDuplicates) + " " + std::to_string(options.coarseDuplicateThreshold);
+    return key;
+}
+
+// 64-bit FNV-1a.
+static uint64_t keyHash(const string& key)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char byte : key) {
+        hash ^= byte;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Written next to a resumable output file, so that it's only resumed by a run with the same options.
+static string resumeKey(const AnalyzerOptions& options)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "%016" PRIx64 "\n", keyHash(ResultCacheVersion + outputOptionsKey(options)));
+    return key;
+}
+
+// Copies the file by way of a temporary file, so that the destination is either missing or complete.
+static bool copyFile(const string& source, const string& destination)
+{
+    std::ifstream sourceFile(source, std::ios::binary);
+    string contents((std::istreambuf_iterator<char>(sourceFile)), std::istreambuf_iterator<char>());
+    if (!sourceFile.is_open() || sourceFile.bad())
+        return false;
+
+    // The temporary file is unique, so that batch jobs copying to the same destination don't write to the same file,
+    // and it's synced before it's renamed, so that the destination can't be left empty by a crash.
+    string temporaryFilename = destination + ".XXXXXX";
+    int fileDescriptor = mkstemp(&temporaryFilename[0]);
+    if (fileDescriptor == -1) {
+        logging(LogLevel::Error, "Error: Failed to create a temporary file for %s: %s", destination.c_str(), strerror(errno));
+        return false;
     }
+    if (fchmod(fileDescriptor, 0644) || !writeContents(fileDescriptor, contents) || fsync(fileDescriptor)) {
+        logging(LogLevel::Error, "Error: Failed to write %s: %s", temporaryFilename.c_str(), strerror(errno));
+        close(fileDescriptor);
+        unlink(temporaryFilename.c_str());
+        return false;
+    }
+    if (close(fileDescriptor)) {
+        logging(LogLevel::Error, "Error: Failed to write %s: %s", temporaryFilename.c_str(), strerror(errno));
+        unlink(temporaryFilename.c_str());
+        return false;
+    }
+
+    if (rename(temporaryFilename.c_str(), destination.c_str())) {
+        logging(LogLevel::Error, "Error: Failed to rename %s to %s: %s", temporaryFilename.c_str(), destination.c_str(), strerror(errno));
+        unlink(temporaryFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+Analyzer::Analyzer(const AnalyzerOptions& options)
+    : m_options(options)
+    , m_analysisStates(new AnalysisState[1 + options.analysisThreads])
+    , m_frameBufferPool(new FrameBufferPool)
+{
+    if (m_options.grids.empty())
+        m_options.grids.push_back({ DefaultHorizontalCellCount, DefaultVerticalCellCount });
+}
+
+Analyzer::~Analyzer() = default;
+
+bool Analyzer::analyze(const char* input, const KeyframeHandler& handleKeyframe, const StreamHandler& handleStream)
+{
+    return analyzeInput(input, nullptr, [&](const StreamInfo& stream, ResumePoint&) {
+        return !handleStream || handleStream(stream);
+    }, handleKeyframe, string());
+}
 
-    auto inputFile = argv[1];
+bool Analyzer::analyze(AVIOContext* ioContext, const char* name, const KeyframeHandler& handleKeyframe, const StreamHandler& handleStream)
+{
+    return analyzeInput(name, ioContext, [&](const StreamInfo& stream, ResumePoint&) {
+        return !handleStream || handleStream(stream);
+    }, handleKeyframe, string());
+}
+
+bool Analyzer::analyzeToFile(const char* inputFile, const char* outputFile, const string& keyframeImagePrefix)
+{
+    auto& options = m_options;
+
+    // If this file has been analyzed with the same options before, reuse the result rather than decoding it again,
+    // unless keyframe images are being exported, which needs the keyframes to be decoded anyway.
+    string cacheEntry;
+    if (options.cacheDirectory && resultCacheEntry(inputFile, options, cacheEntry) && !imageExporter && !access(cacheEntry.c_str(), F_OK)
+        && copyFile(cacheEntry, outputFile)) {
+        logging("Using cached analysis of %s.", inputFile);
+        return true;
+    }
+
+    FrameAnalysisWriter analysisWriter;
+    analysisWriter.setMarksDuplicates(options.markDuplicates);
+    if (options.resume)
+        analysisWriter.setResumeKey(resumeKey(options));
+    auto openOutput = [&](const StreamInfo& stream, ResumePoint& resumePoint) {
+        FrameAnalysisFileHeader header { };
+        header.timeBaseNumerator = stream.timeBase.num;
+        header.timeBaseDenominator = stream.timeBase.den;
+        header.streamIndex = stream.streamIndex;
+        header.width = stream.width;
+        header.height = stream.height;
+        strncpy(header.codecName, stream.codecName, sizeof(header.codecName) - 1);
+        vector<FrameAnalysisFileGrid> grids;
+        for (auto& grid : options.grids)
+            grids.push_back({ grid.columns, grid.rows });
+        header.gridCount = grids.size();
+
+        if (options.resume)
+            return analysisWriter.openResuming(outputFile, options.outputFormat, header, grids.data(), resumePoint);
+        return analysisWriter.open(outputFile, options.outputFormat, header, grids.data());
+    };
+    auto writeKeyframe = [&](const KeyframeAnalysis& keyframe) {
+        return analysisWriter.writeRow(keyframe.timestamp, keyframe.cellMedians.data(), keyframe.cellMedians.size(), keyframe.isDuplicate);
+    };
 
+    if (!analyzeInput(inputFile, nullptr, openOutput, writeKeyframe, keyframeImagePrefix) || !analysisWriter.commit())
+        return false;
+
+    if (!cacheEntry.empty() && !copyFile(outputFile, cacheEntry))
+        logging(LogLevel::Warning, "Warning: Failed to cache the analysis of %s.", inputFile);
+
+    return true;
+}
+
+// Opens the input, reading it through ioContext if it isn't null, and finds and opens the video stream to analyze.
+// Once the stream is known, handleStream is called with it, and may set the point to resume from; each keyframe
+// is then analyzed and handed to handleKeyframe, in presentation order. The names of its keyframe images, if they're
+// being exported, start with keyframeImagePrefix.
+bool Analyzer::analyzeInput(const char* inputFile, AVIOContext* ioContext, const ResumingStreamHandler& handleStream, const KeyframeHandler& handleKeyframe, const string& keyframeImagePrefix)
+{
+    auto& options = m_options;
+    ScopedThreadAffinity threadAffinity(options.cpus);
     logging("Opening input file %s...", inputFile);
 
+    // The format context reads through the input reader, so the reader has to outlive it.
+    InputReader inputReader;
+    if (!ioContext && !inputReader.open(inputFile, options.readBufferSize))
+        return false;
+
     // It's not possible to get a pointer to a unique_ptr's internal pointer, but avformat_open_input takes a pointer
     // to the dest pointer, so we pass a raw pointer and then "adopt" it into the AVInputFileFormatContextPtr.
-    AVFormatContext* formatContextRawPointer = nullptr;
+    AVFormatContext* formatContextRawPointer = avformat_alloc_context();
+    formatContextRawPointer->pb = ioContext ? ioContext : inputReader.ioContext();
+    if (options.fastProbe) {
+        formatContextRawPointer->probesize = FastProbeSize;
+        formatContextRawPointer->max_analyze_duration = FastProbeAnalyzeDuration;
+    }
     int result = avformat_open_input(&formatContextRawPointer, inputFile, nullptr, nullptr);
     AVInputFileFormatContextPtr formatContext(formatContextRawPointer);
     if (result) {
-        logging("Error: Failed to open input file: %s", AVError(result));
-        return -1;
+        logging(LogLevel::Error, "Error: Failed to open input file: %s", AVError(result));
+        return false;
     }
 
-    logging("    Format %s, duration %lld us, bit_rate %lld\n", formatContext->iformat->name, formatContext->duration, formatContext->bit_rate);
+    logging("    Format %s, duration %" PRId64 " us, bit_rate %" PRId64 "\n", formatContext->iformat->name, formatContext->duration, formatContext->bit_rate);
 
     result = avformat_find_stream_info(formatContext.get(), nullptr);
     if (result) {
-        logging("Error: Failed to find stream info: %s", AVError(result));
-        return -1;
+        logging(LogLevel::Error, "Error: Failed to find stream info: %s", AVError(result));
+        return false;
     }
 
-    AVCodec* videoCodec = nullptr;
-    AVCodecParameters* videoCodecParameters = nullptr;
-    AVRational videoTimeBase;
-    int videoStreamIndex = 0;
-
-    // Loop though all streams, and print some information about them. Find the first video stream for which we have a
-    // decoder installed; this is the stream we'll analyze.
-    for (unsigned i = 0; i < formatContext->nb_streams; i++) {
+    // Print some information about each stream, unless we're trying to start as quickly as possible. Only the analyzed
+    // stream needs a decoder, so the others are described by their codec IDs.
+    for (unsigned i = 0; !options.fastProbe && i < formatContext->nb_streams; i++) {
         AVStream* stream = formatContext->streams[i];
         logging("Stream #%u", i);
         logging("    AVStream->time_base before open coded %d/%d", stream->time_base.num, stream->time_base.den);
         logging("    AVStream->r_frame_rate before open coded %d/%d", stream->r_frame_rate.num, stream->r_frame_rate.den);
         logging("    AVStream->start_time %" PRId64, stream->start_time);
-        logging("    AVStream->duration %" PRId64, stream->duration);
-        logging("");
+        logging("    AVStream->duration %" PRId64 "\n", stream->duration);
 
         AVCodecParameters* codecParameters = stream->codecpar;
-        AVCodec* codec = avcodec_find_decoder(codecParameters->codec_id);
-        if (!codec) {
-            logging("Warning: No codec found for stream.");
-            continue;
-        }
-
-        if (!videoCodec && codecParameters->codec_type == AVMEDIA_TYPE_VIDEO) {
-            // FIXME: Is it possible to have multiple video streams? What should the behavior be in that case?
-            videoStreamIndex = i;
-            videoCodec = codec;
-            videoCodecParameters = codecParameters;
-            videoTimeBase = stream->time_base;
+        if (codecParameters->codec_type == AVMEDIA_TYPE_VIDEO)
             logging("    Video Codec: resolution %d x %d", codecParameters->width, codecParameters->height);
-        } else if (codecParameters->codec_type == AVMEDIA_TYPE_AUDIO)
+        else if (codecParameters->codec_type == AVMEDIA_TYPE_AUDIO)
             logging("    Audio Codec: channels %d, sample rate %d", codecParameters->channels, codecParameters->sample_rate);
 
-        logging("        Codec name %s, ID %d, bit_rate %lld\n", codec->name, codec->id, codecParameters->bit_rate);
+        logging("        Codec name %s, ID %d, bit_rate %" PRId64 "\n", avcodec_get_name(codecParameters->codec_id), codecParameters->codec_id, codecParameters->bit_rate);
     }
 
-    if (!videoCodec) {
-        logging("Error: Failed to find a decodable video stream in input file.");
-        return -1;
+    // Analyze the video stream given with --stream, or otherwise the one FFmpeg considers the best: the default stream,
+    // if the file marks one, or the one with the most frames or the highest resolution.
+    AVCodec* videoCodec = nullptr;
+    int videoStreamIndex = av_find_best_stream(formatContext.get(), AVMEDIA_TYPE_VIDEO, options.streamIndex, -1, &videoCodec, 0);
+    if (videoStreamIndex < 0) {
+        if (options.streamIndex >= 0)
+            logging(LogLevel::Error, "Error: Stream %d isn't a decodable video stream: %s", options.streamIndex, AVError(videoStreamIndex));
+        else
+            logging(LogLevel::Error, "Error: Failed to find a decodable video stream in input file: %s", AVError(videoStreamIndex));
+        return false;
+    }
+
+    // Only the analyzed stream is needed, so have the demuxer discard the others, rather than reading and parsing their
+    // packets only for them to be skipped below. Where the container allows it, their payloads aren't even read.
+    for (unsigned i = 0; i < formatContext->nb_streams; ++i) {
+        if (static_cast<int>(i) != videoStreamIndex)
+            formatContext->streams[i]->discard = AVDISCARD_ALL;
     }
+    if (options.demuxKeyframesOnly)
+        formatContext->streams[videoStreamIndex]->discard = AVDISCARD_NONKEY;
+
+    AVCodecParameters* videoCodecParameters = formatContext->streams[videoStreamIndex]->codecpar;
+    AVRational videoTimeBase = formatContext->streams[videoStreamIndex]->time_base;
+    logging("Analyzing stream #%d, codec %s.", videoStreamIndex, videoCodec->name);
 
     int width = videoCodecParameters->width;
     int height = videoCodecParameters->height;
-    if (width <= 0 || static_cast<unsigned>(width) < HorizontalCellCount ||
-        height <= 0 || static_cast<unsigned>(height) < VerticalCellCount) {
-        logging("Error: Width and/or height of video stream is less than desired cell count.");
-        return -1;
+    for (auto& grid : options.grids) {
+        if (width <= 0 || static_cast<unsigned>(width) < grid.columns ||
+            height <= 0 || static_cast<unsigned>(height) < grid.rows) {
+            logging(LogLevel::Error, "Error: Width and/or height of video stream is less than desired cell count.");
+            return false;
+        }
     }
 
+    // The hardware pixel format the decoder is asked to produce by selectHardwarePixelFormat, if hardware decoding is
+    // used. This must outlive the codec context.
+    AVPixelFormat hardwarePixelFormat = AV_PIX_FMT_NONE;
+
     AVCodecContextPtr codecContext(avcodec_alloc_context3(videoCodec));
     result = avcodec_parameters_to_context(codecContext.get(), videoCodecParameters);
     if (result < 0) {
-        logging("Error: Failed to copy codec parameters to codec context: %s", AVError(result));
-        return -1;
+        logging(LogLevel::Error, "Error: Failed to copy codec parameters to codec context: %s", AVError(result));
+        return false;
+    }
+
+    // Let the decoder use both frame and slice threading. Frame threading delays the output of each frame by up to
+    // thread_count frames, so the decoder has to be drained once the input is exhausted; see below.
+    codecContext->thread_count = options.decodeThreads;
+    codecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    if (options.hardwareDecoder && !setUpHardwareDecoding(codecContext.get(), videoCodec, options.hardwareDecoder, hardwarePixelFormat))
+        logging(LogLevel::Warning, "Warning: Hardware decoding with %s is not available; using software decoding.", options.hardwareDecoder);
+
+    // While pinned, decode into the Analyzer's pool, so that frames stay in memory local to its CPUs. Hardware decoding
+    // decodes into device memory, and already uses the codec context's opaque pointer.
+    if (!options.cpus.empty() && !codecContext->hw_device_ctx) {
+        codecContext->opaque = m_frameBufferPool.get();
+        codecContext->get_buffer2 = getPooledFrameBuffer;
+#if LIBAVCODEC_VERSION_MAJOR < 59
+        // Let frame threads allocate their frames themselves, rather than waiting for this thread to do it for them.
+        // Later versions of FFmpeg always do.
+        codecContext->thread_safe_callbacks = 1;
+#endif
     }
 
     result = avcodec_open2(codecContext.get(), videoCodec, nullptr);
     if (result < 0) {
-        logging("Error: Failed to open codec: %s", AVError(result));
-        return -1;
+        logging(LogLevel::Error, "Error: Failed to open codec: %s", AVError(result));
+        return false;
     }
 
+    logging("Decoding with %d threads, %s%s threading.", codecContext->thread_count,
+        codecContext->active_thread_type & FF_THREAD_FRAME ? "frame" : "no frame",
+        codecContext->active_thread_type & FF_THREAD_SLICE ? " and slice" : "");
+
     // Skip non-keyframes when processing.
     codecContext->skip_frame = AVDISCARD_NONKEY;
 
-    // Remove the existing analysis file, if any.
-    remove(FrameAnalysisCSVFile);
+    StreamAnalysis streamAnalysis;
+    streamAnalysis.options = &options;
+    streamAnalysis.codecContext = codecContext.get();
+    streamAnalysis.analysisStates = m_analysisStates.get();
+    streamAnalysis.handleKeyframe = &handleKeyframe;
+    for (unsigned i = 0; i < 1 + options.analysisThreads; ++i) {
+        m_analysisStates[i].samplingError = SamplingError();
+        m_analysisStates[i].keyframeImagePrefix = keyframeImagePrefix;
+    }
+
+    ResumePoint resumePoint;
+    if (!handleStream({ videoStreamIndex, width, height, videoTimeBase, videoCodec->name }, resumePoint))
+        return false;
+    streamAnalysis.duplicateFilter.lastMedians = std::move(resumePoint.lastMedians);
 
-    while (true) {
-        AVPacketPtr packet(av_packet_alloc());
-        result = av_read_frame(formatContext.get(), packet.get());
-        if (result == AVERROR_EOF) {
-            // If we reach the end of the stream, exit cleanly.
-            break;
-        }
+    bool analysisSucceeded;
+    if (options.analysisThreads)
+        analysisSucceeded = analyzeStreamPipelined(formatContext.get(), videoStreamIndex, streamAnalysis, options, resumePoint);
+    else {
+        // Every keyframe is decoded into the same frame, so once the decoder's buffer pools are warmed up, demuxing,
+        // decoding and analyzing a keyframe doesn't allocate.
+        AVFramePtr decodedFrame(av_frame_alloc());
+        analysisSucceeded = demuxKeyframePackets(formatContext.get(), videoStreamIndex, options, resumePoint, [&](AVPacket* packet) {
+            return decodePacket(packet, codecContext.get(), decodedFrame.get(), [&](AVFrame* frame) {
+                return processKeyframe(streamAnalysis, frame);
+            });
+        });
+    }
 
-        if (result < 0) {
-            logging("Error: Failed to read packet from stream: %s", AVError(result));
-            return -1;
-        }
+    if (!analysisSucceeded)
+        return false;
 
-        if (packet->stream_index != videoStreamIndex)
-            continue;
+    if (options.duplicateThreshold >= 0 || options.coarseDuplicateThreshold >= 0) {
+        auto& duplicateFilter = streamAnalysis.duplicateFilter;
+        logging("%s %" PRIu64 " near-duplicate keyframes, and dropped %" PRIu64 " before analysis.", options.markDuplicates ? "Marked" : "Dropped",
+            duplicateFilter.duplicateCount, duplicateFilter.coarseDuplicateCount);
+    }
 
-        if (!processPacket(packet.get(), codecContext.get(), videoTimeBase)) {
-            logging("Error: Failed to process packet.");
-            return -1;
-        }
+    if (options.reportSamplingError) {
+        auto& samplingError = m_analysisStates[0].samplingError;
+        logging("Sampling error: mean %.3f, maximum %.1f, over %" PRIu64 " cells.",
+            samplingError.cellCount ? samplingError.totalError / samplingError.cellCount : 0.0, samplingError.maximumError, samplingError.cellCount);
     }
 
     logging("Processing complete.");
 
-    return 0;
+    return true;
 }
 
-static const char* AVError(int errorCode)
+KeyframeStream::KeyframeStream(Analyzer& analyzer, const char* input)
+    : m_input(input)
+    , m_queue(analyzer.options().queueDepth)
 {
-    static char errorString[AV_ERROR_MAX_STRING_SIZE];
-    av_make_error_string(errorString, AV_ERROR_MAX_STRING_SIZE, errorCode);
-    return errorString;
+    m_thread = std::thread([this, &analyzer] {
+        m_succeeded = analyzer.analyze(m_input.c_str(), [this](const KeyframeAnalysis& keyframe) {
+            KeyframeAnalysis queuedKeyframe = keyframe;
+            return m_queue.push(std::move(queuedKeyframe));
+        });
+        m_queue.close();
+    });
 }
 
-static void logging(const char* fmt, ...)
+KeyframeStream::~KeyframeStream()
 {
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
+    m_queue.abort();
+    m_thread.join();
 }
 
-static bool processPacket(const AVPacket* packet, AVCodecContext* codecContext, const AVRational& timeBase)
+bool KeyframeStream::next(KeyframeAnalysis& keyframe)
 {
-    int result = avcodec_send_packet(codecContext, packet);
-    if (result < 0) {
-        logging("Error: Failed sending packet to the decoder: %s", AVError(result));
-        return false;
-    }
-
-    while (true) {
-        // Process a single frame from the decoder. If the decoder returns EAGAIN, more input data is needed to decode
-        // the next frame. If it returns EOF, we've reached the end of the stream.
-        AVFramePtr frame(av_frame_alloc());
-        result = avcodec_receive_frame(codecContext, frame.get());
-        if (result == AVERROR(EAGAIN) || result == AVERROR_EOF)
-            return true;
+    return m_queue.pop(keyframe);
+}
 
-        if (result < 0) {
-            logging("Error: Failed to receive a frame from the decoder: %s", AVError(result));
-            return false;
-        }
+// The decoder calls this with the pixel formats it can produce for the stream; pick the hardware format if it's among
+// them. Otherwise, hardware decoding isn't possible for this stream after all, so fall back to a software format.
+static AVPixelFormat selectHardwarePixelFormat(AVCodecContext* codecContext, const AVPixelFormat* formats)
+{
+    auto hardwarePixelFormat = *static_cast<const AVPixelFormat*>(codecContext->opaque);
+    for (auto format = formats; *format != AV_PIX_FMT_NONE; ++format) {
+        if (*format == hardwarePixelFormat)
+            return *format;
+    }
 
-        if (!processKeyframe(codecContext, frame.get(), timeBase)) {
-            logging("Error: Failed to process keyframe.");
-            return false;
-        }
+    logging(LogLevel::Warning, "Warning: Decoder can't output %s for this stream; using software decoding.", av_get_pix_fmt_name(hardwarePixelFormat));
+    for (auto format = formats; *format != AV_PIX_FMT_NONE; ++format) {
+        if (!(av_pix_fmt_desc_get(*format)->flags & AV_PIX_FMT_FLAG_HWACCEL))
+            return *format;
     }
 
-    return true;
+    return AV_PIX_FMT_NONE;
 }
 
-static bool processKeyframe(AVCodecContext* codecContext, AVFrame* frame, const AVRational& timeBase)
+// Attaches a hardware device of the named type to the codec context, so that frames are decoded in device memory.
+// Returns false, leaving the codec context unchanged, if the decoder doesn't support the device type or no such device
+// is available.
+static bool setUpHardwareDecoding(AVCodecContext* codecContext, const AVCodec* codec, const char* deviceTypeName, AVPixelFormat& hardwarePixelFormat)
 {
-    logging("Processing keyframe %d pts %d dts %d...", codecContext->frame_number, frame->pts, frame->coded_picture_number);
-
-    AVFramePtr frameGrayscale(av_frame_alloc());
-    int width = frame->width;
-    int height = frame->height;
-    int result = av_image_alloc(frameGrayscale->data, frameGrayscale->linesize, width, height, AV_PIX_FMT_GRAY8, 32);
-    if (result < 0) {
-        logging("Error: Failed to allocate grayscale image for frame: %s", AVError(result));
+    bool anyDeviceType = !strcmp(deviceTypeName, "auto");
+    auto wantedDeviceType = anyDeviceType ? AV_HWDEVICE_TYPE_NONE : av_hwdevice_find_type_by_name(deviceTypeName);
+    if (!anyDeviceType && wantedDeviceType == AV_HWDEVICE_TYPE_NONE) {
+        logging(LogLevel::Warning, "Warning: Unknown hardware device type %s.", deviceTypeName);
         return false;
     }
 
-    auto srcFormat = codecContext->pix_fmt;
-    auto destFormat = AV_PIX_FMT_GRAY8;
-    int startRow = 0;
-    int rowCount = height;
-    SwsContextPtr conversionContext(sws_getContext(width, height, srcFormat, width, height, destFormat, SWS_BILINEAR, nullptr, nullptr, nullptr));
-    sws_scale(conversionContext.get(), frame->data, frame->linesize, startRow, rowCount, frameGrayscale->data, frameGrayscale->linesize);
+    for (int i = 0; auto config = avcodec_get_hw_config(codec, i); ++i) {
+        if (!(config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX))
+            continue;
+        if (!anyDeviceType && config->device_type != wantedDeviceType)
+            continue;
 
-    // These values aren't set by av_image_alloc, so copy them manually.
-    frameGrayscale->best_effort_timestamp = frame->best_effort_timestamp;
-    frameGrayscale->width = width;
-    frameGrayscale->height = height;
+        AVBufferRef* deviceContext = nullptr;
+        int result = av_hwdevice_ctx_create(&deviceContext, config->device_type, nullptr, nullptr, 0);
+        if (result < 0) {
+            logging(LogLevel::Warning, "Warning: Failed to create %s device: %s", av_hwdevice_get_type_name(config->device_type), AVError(result));
+            continue;
+        }
 
-    if (OutputKeyframeImages) {
-        char frameFilename[1024];
-        snprintf(frameFilename, sizeof(frameFilename), "frame-%d.pgm", codecContext->frame_number);
-        outputGrayscaleFrame(frameGrayscale.get(), frameFilename);
+        logging("Decoding with %s.", av_hwdevice_get_type_name(config->device_type));
+        codecContext->hw_device_ctx = deviceContext;
+        hardwarePixelFormat = config->pix_fmt;
+        codecContext->opaque = &hardwarePixelFormat;
+        codecContext->get_format = selectHardwarePixelFormat;
+        return true;
     }
 
-    bool analysisSucceeded = analyzeGrayscaleFrame(frameGrayscale.get(), timeBase);
+    return false;
+}
 
-    // It's necessary to manually free the data pointer after calling av_image_alloc. See
-    // <https://ffmpeg.org/doxygen/4.1/group__lavu__picture.html#ga841e0a89a642e24141af1918a2c10448>.
-    av_freep(&frameGrayscale->data[0]);
+// Decodes frames into the Analyzer's FrameBufferPool, or into libavcodec's own buffers if the decoder can't decode into
+// the caller's buffers, or the pool doesn't allocate the frame.
+static int getPooledFrameBuffer(AVCodecContext* codecContext, AVFrame* frame, int flags)
+{
+    auto frameBufferPool = static_cast<FrameBufferPool*>(codecContext->opaque);
+    if ((codecContext->codec->capabilities & AV_CODEC_CAP_DR1) && frameBufferPool->allocate(codecContext, frame))
+        return 0;
+    return avcodec_default_get_buffer2(codecContext, frame, flags);
+}
 
-    return analysisSucceeded;
+FrameBufferPool::~FrameBufferPool()
+{
+    release();
 }
 
-static inline float median(vector<uint8_t>& v)
+bool FrameBufferPool::allocate(AVCodecContext* codecContext, AVFrame* frame)
 {
-    int middle = v.size() / 2;
-    nth_element(v.begin(), v.begin() + middle, v.end());
-    float median = v[middle];
+    // Hardware frames are allocated by their device, and paletted frames need a palette as well.
+    auto format = static_cast<AVPixelFormat>(frame->format);
+    auto descriptor = av_pix_fmt_desc_get(format);
+    if (!descriptor || (descriptor->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)))
+        return false;
 
-    // For sets with an odd number of items, the median is the middle element.
-    if (v.size() & 1)
-        return median;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool isConfigured = codecContext->codec_id == m_codecID && format == m_format && frame->width == m_width && frame->height == m_height;
+    if (!isConfigured && !configure(codecContext, format, frame->width, frame->height))
+        return false;
 
-    // For sets with an even number of items, the median is the average of the middle two elements. It is more efficient
-    // to call max_element on the lower half of the list than it is to call nth_element() again.
-    // FIXME: Although this gives the true median, it's probably unnecessarily precise. For our purposes, it's probably
-    // fine to just return the first value found above and avoid another O(n) operation.
-    auto iter = max_element(v.begin(), v.begin() + middle - 1);
-    return (median + *iter) / 2;
+    for (int i = 0; i < 4 && m_pools[i]; ++i) {
+        frame->buf[i] = av_buffer_pool_get(m_pools[i]);
+        if (!frame->buf[i]) {
+            for (int j = 0; j < i; ++j) {
+                av_buffer_unref(&frame->buf[j]);
+                frame->data[j] = nullptr;
+                frame->linesize[j] = 0;
+            }
+            return false;
+        }
+        frame->data[i] = frame->buf[i]->data;
+        frame->linesize[i] = m_linesizes[i];
+    }
+    frame->extended_data = frame->data;
+    return true;
 }
 
-static inline float cellMedian(const uint8_t* data, int lineSize, unsigned xOffset, unsigned xPixels, unsigned yOffset, unsigned yPixels)
+// Sizes the buffers as libavcodec's own pools do: the frame is padded to the dimensions the decoder needs, and then
+// widened until every plane's lines have the alignment it needs.
+bool FrameBufferPool::configure(AVCodecContext* codecContext, AVPixelFormat format, int frameWidth, int frameHeight)
 {
-    vector<uint8_t> pixels(xPixels * yPixels);
-    for (unsigned y = 0; y < yPixels; ++y) {
-        // Horizontal lines may contain additional padding bytes. lineSize includes this padding, so use it to determine
-        // the start of each row. See <https://ffmpeg.org/doxygen/trunk/structAVFrame.html#aa52bfc6605f6a3059a0c3226cc0f6567>.
-        memcpy(&pixels[y * xPixels], &data[(yOffset + y) * lineSize + xOffset], xPixels);
+    release();
+
+    int width = frameWidth;
+    int height = frameHeight;
+    int linesizeAlignments[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(codecContext, &width, &height, linesizeAlignments);
+    bool isAligned;
+    do {
+        if (av_image_fill_linesizes(m_linesizes, format, width) < 0)
+            return false;
+        width += width & ~(width - 1);
+
+        isAligned = true;
+        for (int i = 0; i < 4; ++i)
+            isAligned = isAligned && !(m_linesizes[i] % linesizeAlignments[i]);
+    } while (!isAligned);
+
+    // Decoders may read slightly past the end of each plane.
+    auto descriptor = av_pix_fmt_desc_get(format);
+    int planeCount = av_pix_fmt_count_planes(format);
+    for (int i = 0; i < planeCount; ++i) {
+        int planeHeight = i == 1 || i == 2 ? AV_CEIL_RSHIFT(height, descriptor->log2_chroma_h) : height;
+        m_pools[i] = av_buffer_pool_init(m_linesizes[i] * planeHeight + 16 + FrameBufferAlignment - 1, av_buffer_allocz);
+        if (!m_pools[i]) {
+            release();
+            return false;
+        }
     }
 
-    return median(pixels);
+    m_codecID = codecContext->codec_id;
+    m_format = format;
+    m_width = frameWidth;
+    m_height = frameHeight;
+    return true;
 }
 
-static bool outputFrameAnalysis(AVFrame* frame, const float* values, unsigned count, const AVRational& timeBase)
+// Buffers that frames still refer to are freed once the frames release them, so the pools can be released at any time.
+void FrameBufferPool::release()
 {
-    ofstream outputFile(FrameAnalysisCSVFile, ios::app);
-    if (!outputFile.good()) {
-        logging("Error: Failed to open CSV file.");
-        return false;
-    }
+    for (auto& pool : m_pools)
+        av_buffer_pool_uninit(&pool);
+    m_format = AV_PIX_FMT_NONE;
+}
 
-    float timestamp = frame->best_effort_timestamp * av_q2d(timeBase);
+#if defined(__linux__)
+ScopedThreadAffinity::ScopedThreadAffinity(const vector<unsigned>& cpus)
+{
+    if (cpus.empty())
+        return;
 
-    outputFile << timestamp;
-    for (unsigned i = 0; i < count; ++i)
-        outputFile << "," << values[i];
-    outputFile << endl;
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (unsigned cpu : cpus) {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &cpuSet);
+    }
 
-    return true;
+    int result = pthread_getaffinity_np(pthread_self(), sizeof(m_previousCPUs), &m_previousCPUs);
+    if (!result)
+        result = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+    if (result) {
+        logging(LogLevel::Warning, "Warning: Failed to pin threads to the given CPUs: %s", strerror(result));
+        return;
+    }
+    m_isPinned = true;
 }
 
-static bool analyzeGrayscaleFrame(AVFrame* frame, const AVRational& timeBase)
+ScopedThreadAffinity::~ScopedThreadAffinity()
 {
-    int remainingHeight = frame->height;
-    int lineSize = frame->linesize[0];
-    auto data = frame->data[0];
-    array<float, VerticalCellCount * HorizontalCellCount> cellMedians;
+    if (m_isPinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(m_previousCPUs), &m_previousCPUs);
+}
+#else
+ScopedThreadAffinity::ScopedThreadAffinity(const vector<unsigned>& cpus)
+{
+    if (!cpus.empty())
+        logging(LogLevel::Warning, "Warning: Pinning threads to CPUs isn't supported on this system.");
+}
 
-    for (unsigned y = 0; y < VerticalCellCount; ++y) {
-        unsigned yOffset = frame->height - remainingHeight;
-        unsigned yPixels = remainingHeight / (VerticalCellCount - y);
-        remainingHeight -= yPixels;
+ScopedThreadAffinity::~ScopedThreadAffinity() = default;
+#endif
 
-        int remainingWidth = frame->width;
-        for (unsigned x = 0; x < HorizontalCellCount; ++x) {
-            unsigned xOffset = frame->width - remainingWidth;
-            unsigned xPixels = remainingWidth / (HorizontalCellCount - x);
-            remainingWidth -= xPixels;
+// Copies a frame decoded in device memory to system memory. The decoder's hardware frames can usually be transferred
+// in several formats; prefer one with a luma plane that can be analyzed directly, like NV12 or P010, so that the
+// transfer doesn't involve a conversion.
+static AVFramePtr downloadHardwareFrame(const AVFrame* frame)
+{
+    AVFramePtr softwareFrame(av_frame_alloc());
 
-            float median = cellMedian(data, lineSize, xOffset, xPixels, yOffset, yPixels);
-            cellMedians[y * HorizontalCellCount + x] = median;
+    AVPixelFormat* formats = nullptr;
+    if (av_hwframe_transfer_get_formats(frame->hw_frames_ctx, AV_HWFRAME_TRANSFER_DIRECTION_FROM, &formats, 0) >= 0) {
+        for (auto format = formats; *format != AV_PIX_FMT_NONE; ++format) {
+            if (hasDirectLumaPlane(*format) || hasHighBitDepthLumaPlane(*format)) {
+                softwareFrame->format = *format;
+                break;
+            }
         }
+        av_freep(&formats);
     }
 
-    return outputFrameAnalysis(frame, cellMedians.data(), cellMedians.size(), timeBase);
+    int result = av_hwframe_transfer_data(softwareFrame.get(), frame, 0);
+    if (result < 0) {
+        logging(LogLevel::Error, "Error: Failed to transfer frame from hardware device: %s", AVError(result));
+        return nullptr;
+    }
+    // The transfer only copies the pixels; the color range, in particular, is needed to analyze them.
+    av_frame_copy_props(softwareFrame.get(), frame);
+
+    return softwareFrame;
 }
 
-static bool outputGrayscaleFrame(AVFrame* frame, const char* filename)
+// Reads the video stream's keyframe packets and hands each one to handlePacket, followed by a null packet at the end of
+// the stream, so that the frames still buffered by the decoder can be drained. Every packet is read into the same
+// AVPacket, which is only valid during the call; a handler that keeps it must move its reference elsewhere. When
+// resuming, only the keyframes after the resume point are read, and the rows already written count towards the
+// maximum number of keyframes. Returns false if reading fails or if handlePacket returns false.
+template<typename PacketHandler>
+static bool demuxKeyframePackets(AVFormatContext* formatContext, int videoStreamIndex, const AnalyzerOptions& options, const ResumePoint& resumePoint, PacketHandler handlePacket)
 {
-    ofstream outputFile(filename, ios::binary);
-    if (!outputFile.good())
-        return false;
+    vector<KeyframeIndexEntry> keyframes;
+    if (options.seekKeyframes && !(formatContext->pb->seekable & AVIO_SEEKABLE_NORMAL))
+        logging(LogLevel::Warning, "Warning: Input isn't seekable; reading the entire stream.");
+    else if (options.seekKeyframes) {
+        keyframes = keyframeIndex(formatContext->streams[videoStreamIndex]);
+        if (keyframes.empty())
+            logging(LogLevel::Warning, "Warning: Input file has no keyframe index; reading the entire stream.");
+        else
+            logging("Seeking through %zu indexed keyframes.", keyframes.size());
+    }
+    size_t nextKeyframe = 0;
+    size_t lastSeekedKeyframe = SIZE_MAX;
+    AVPacketPtr packet(av_packet_alloc());
 
-    int width = frame->width;
-    int height = frame->height;
+    AVRational timeBase = formatContext->streams[videoStreamIndex]->time_base;
+    AVRational microseconds { 1, AV_TIME_BASE };
+    int64_t startTimestamp = options.startTime != AV_NOPTS_VALUE ? av_rescale_q(options.startTime, microseconds, timeBase) : AV_NOPTS_VALUE;
+    int64_t endTimestamp = options.endTime != AV_NOPTS_VALUE ? av_rescale_q(options.endTime, microseconds, timeBase) : AV_NOPTS_VALUE;
+    uint64_t keyframeCount = 0;
+    if (options.shardCount && !restrictToShard(formatContext, videoStreamIndex, options, startTimestamp, endTimestamp))
+        return false;
 
-    // For format description, see <https://en.wikipedia.org/wiki/Netpbm_format#PGM_example>
-    outputFile << "P5\n" << width << " " << height << "\n" << 255 << "\n";
+    // Resuming an interrupted analysis picks up after the last keyframe it wrote.
+    if (resumePoint.timestamp != AV_NOPTS_VALUE) {
+        logging("Resuming after timestamp %" PRId64 ", with %" PRIu64 " keyframes written.", resumePoint.timestamp, resumePoint.rowCount);
+        if (startTimestamp == AV_NOPTS_VALUE || startTimestamp <= resumePoint.timestamp)
+            startTimestamp = resumePoint.timestamp + 1;
+        keyframeCount = resumePoint.rowCount;
+    }
 
-    // We cannot write the entire contents of buffer, because each horizontal line may contain additional padding bytes
-    // for performance reasons. lineSize includes this padding, so use it to determine the start of each row. See
-    // <https://ffmpeg.org/doxygen/trunk/structAVFrame.html#aa52bfc6605f6a3059a0c3226cc0f6567>.
-    int lineSize = frame->linesize[0];
-    auto data = frame->data[0];
-    for (int i = 0; i < height; ++i) {
-        auto lineStart = &data[i * lineSize];
-        outputFile.write(reinterpret_cast<char*>(lineStart), width);
+    // Seek to the last keyframe at or before the start time, rather than reading everything before it. Any earlier
+    // keyframes the demuxer returns are skipped below.
+    if (startTimestamp != AV_NOPTS_VALUE) {
+        int result = av_seek_frame(formatContext, videoStreamIndex, startTimestamp, AVSEEK_FLAG_BACKWARD);
+        if (result < 0)
+            logging(LogLevel::Warning, "Warning: Failed to seek to the start time; reading from the beginning: %s", AVError(result));
     }
 
-    return true;
+    while (true) {
+        // If the next indexed keyframe is far enough ahead, seek directly to it. Each keyframe is only sought once, so
+        // that if the demuxer lands short of it, we read forward instead of seeking to the same place forever.
+        if (nextKeyframe < keyframes.size() && nextKeyframe != lastSeekedKeyframe && formatContext->pb &&
+            keyframes[nextKeyframe].position - avio_tell(formatContext->pb) > KeyframeSeekThreshold) {
+            lastSeekedKeyframe = nextKeyframe;
+            int result = av_seek_frame(formatContext, videoStreamIndex, keyframes[nextKeyframe].timestamp, AVSEEK_FLAG_BACKWARD);
+            if (result < 0) {
+                logging(LogLevel::Warning, "Warning: Failed to seek to keyframe; reading the rest of the stream: %s", AVError(result));
+                keyframes.clear();
+            }
+        }
+
+        // Release the previous packet's data, whether it was skipped or handled.
+        av_packet_unref(packet.get());
+
+        int result;
+        {
+            StageTimer timer(Stage::Read);
+            result = av_read_frame(formatContext, packet.get());
+        }
+        if (result == AVERROR_EOF) {
+            // If we reach the end of the stream, exit cleanly.
+            return handlePacket(nullptr);
+        }
+
+        if (result < 0) {
+            logging(LogLevel::Error, "Error: Failed to read packet from stream: %s", AVError(result));
+            return false;
+        }
+
+        // Demuxers that don't support discarding streams still return their packets.
+        if (packet->stream_index != videoStreamIndex)
+            continue;
+
+        if (performanceStatistics)
+            performanceStatistics->addPacketRead();
+
+        // Only keyframes are analyzed, and the decoder can decode them on their own, so don't bother sending it the
+        // packets in between.
+        if (!(packet->flags & AV_PKT_FLAG_KEY))
+            continue;
+
+        int64_t packetTimestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+        while (nextKeyframe < keyframes.size() && packetTimestamp != AV_NOPTS_VALUE && keyframes[nextKeyframe].timestamp <= packetTimestamp)
+            ++nextKeyframe;
+
+        if (packet->pts != AV_NOPTS_VALUE && startTimestamp != AV_NOPTS_VALUE && packet->pts < startTimestamp)
+            continue;
+
+        // Keyframes are decoded in presentation order, so once one is past the end of the range, or the limit is
+        // reached, there's nothing left to read.
+        if ((packet->pts != AV_NOPTS_VALUE && endTimestamp != AV_NOPTS_VALUE && packet->pts >= endTimestamp)
+            || (options.maximumKeyframeCount && keyframeCount >= options.maximumKeyframeCount))
+            return handlePacket(nullptr);
+        ++keyframeCount;
+
+        if (!handlePacket(packet.get()))
+            return false;
+    }
+}
+
+// Sends a packet to the decoder and hands every frame it returns to handleFrame. If packet is null, the decoder is
+// drained of all of its buffered frames. Each frame is received into the given frame, and unreferenced once
+// handleFrame returns, so a handler that keeps it must move its reference elsewhere.
+template<typename FrameHandler>
+static bool decodePacket(const AVPacket* packet, AVCodecContext* codecContext, AVFrame* frame, FrameHandler handleFrame)
+{
+    int result;
+    {
+        StageTimer timer(Stage::SendPacket);
+        result = avcodec_send_packet(codecContext, packet);
+    }
+    if (result < 0) {
+        logging(LogLevel::Error, "Error: Failed sending packet to the decoder: %s", AVError(result));
+        return false;
+    }
+    if (packet && performanceStatistics)
+        performanceStatistics->addPacketDecoded();
+
+    while (true) {
+        // Process a single frame from the decoder. If the decoder returns EAGAIN, more input data is needed to decode
+        // the next frame. If it returns EOF, we've reached the end of the stream.
+        {
+            StageTimer timer(Stage::ReceiveFrame);
+            result = avcodec_receive_frame(codecContext, frame);
+        }
+        if (result == AVERROR(EAGAIN) || result == AVERROR_EOF)
+            return true;
+
+        if (result < 0) {
+            logging(LogLevel::Error, "Error: Failed to receive a frame from the decoder: %s", AVError(result));
+            return false;
+        }
+
+        bool handled = handleFrame(frame);
+        av_frame_unref(frame);
+        if (!handled) {
+            logging(LogLevel::Error, "Error: Failed to process keyframe.");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void logQueueStatistics(const char* name, const QueueStatistics& statistics)
+{
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+    logging("    %s: %" PRIu64 " items, maximum depth %zu, producers waited %.1f ms, consumers waited %.1f ms", name,
+        statistics.itemCount, statistics.maximumDepth, Milliseconds(statistics.pushWaitTime).count(), Milliseconds(statistics.popWaitTime).count());
+}
+
+// Analyzes the stream as a pipeline of stages, each on its own threads and connected by bounded queues: demuxing on
+// the calling thread, decoding, analysis on options.analysisThreads threads, and writing. Keyframes are numbered in the
+// order the decoder returns them, which is pts order, and the writer puts their results back in that order.
+static bool analyzeStreamPipelined(AVFormatContext* formatContext, int videoStreamIndex, StreamAnalysis& streamAnalysis, const AnalyzerOptions& options, const ResumePoint& resumePoint)
+{
+    BoundedQueue<AVPacketPtr> packetQueue(options.queueDepth);
+    BoundedQueue<KeyframeWork> keyframeQueue(options.queueDepth);
+    BoundedQueue<KeyframeResult> resultQueue(options.queueDepth);
+
+    // If any stage fails, stop all of them.
+    std::atomic<bool> failed { false };
+    auto fail = [&] {
+        failed = true;
+        packetQueue.abort();
+        keyframeQueue.abort();
+        resultQueue.abort();
+    };
+
+    auto codecContext = streamAnalysis.codecContext;
+    std::thread decoder([&] {
+        uint64_t sequenceNumber = 0;
+        AVPacketPtr packet;
+        AVFramePtr decodedFrame(av_frame_alloc());
+        while (packetQueue.pop(packet)) {
+            bool decoded = decodePacket(packet.get(), codecContext, decodedFrame.get(), [&](AVFrame* frame) {
+                int keyframeNumber = codecContext->frame_number;
+                logging(LogLevel::Verbose, "Decoded keyframe %d pts %" PRId64 " dts %d...", keyframeNumber, frame->pts, frame->coded_picture_number);
+                if (streamAnalysis.duplicateFilter.isCoarseDuplicate(frame, options))
+                    return true;
+                auto decodedTime = performanceStatistics ? PerformanceStatistics::Clock::now() : PerformanceStatistics::Clock::time_point();
+                // Hardware decoders decode into a fixed number of surfaces, which keyframes waiting in the queue, or
+                // being analyzed, would hold on to until the decoder ran out. Download them here instead, so that each
+                // surface is released as soon as it's been decoded.
+                AVFramePtr queuedFrame;
+                if (frame->hw_frames_ctx) {
+                    queuedFrame = downloadHardwareFrame(frame);
+                    if (!queuedFrame)
+                        return false;
+                } else {
+                    queuedFrame.reset(av_frame_alloc());
+                    av_frame_move_ref(queuedFrame.get(), frame);
+                }
+                return keyframeQueue.push({ sequenceNumber++, keyframeNumber, std::move(queuedFrame), decodedTime });
+            });
+            if (!decoded) {
+                fail();
+                break;
+            }
+        }
+        keyframeQueue.close();
+    });
+
+    std::atomic<unsigned> runningAnalyzerCount { options.analysisThreads };
+    std::mutex samplingErrorLock;
+    vector<std::thread> analyzers;
+    for (unsigned i = 0; i < options.analysisThreads; ++i) {
+        analyzers.emplace_back([&, i] {
+            auto& analysisState = streamAnalysis.analysisStates[1 + i];
+            KeyframeWork work;
+            while (keyframeQueue.pop(work)) {
+                KeyframeResult result;
+                result.sequenceNumber = work.sequenceNumber;
+                result.analysis.timestamp = work.frame->best_effort_timestamp;
+                result.analysis.keyframeNumber = work.keyframeNumber;
+                result.decodedTime = work.decodedTime;
+                if (!analyzeKeyframe(work.frame.get(), work.keyframeNumber, options, analysisState, result.analysis.cellMedians) || !resultQueue.push(std::move(result))) {
+                    fail();
+                    break;
+                }
+                work.frame.reset();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(samplingErrorLock);
+                streamAnalysis.analysisStates[0].samplingError.add(analysisState.samplingError);
+            }
+
+            // The last analyzer to finish closes the result queue.
+            if (!--runningAnalyzerCount)
+                resultQueue.close();
+        });
+    }
+
+    std::thread writer([&] {
+        // Results arrive in the order the analyzers finish them, so hold on to each one until the results before it
+        // have been written.
+        std::map<uint64_t, KeyframeResult> pendingResults;
+        uint64_t nextSequenceNumber = 0;
+        KeyframeResult result;
+        while (resultQueue.pop(result)) {
+            pendingResults.emplace(result.sequenceNumber, std::move(result));
+            while (!pendingResults.empty() && pendingResults.begin()->first == nextSequenceNumber) {
+                auto& nextResult = pendingResults.begin()->second;
+                if (!emitKeyframe(streamAnalysis, nextResult.analysis, nextResult.decodedTime)) {
+                    fail();
+                    return;
+                }
+                pendingResults.erase(pendingResults.begin());
+                ++nextSequenceNumber;
+            }
+        }
+    });
+
+    // Only the keyframe packets that are handed to the decoder need packets of their own; the rest of the stream is
+    // read into the demuxer's one packet.
+    auto queuePacket = [&](AVPacket* packet) {
+        AVPacketPtr queuedPacket;
+        if (packet) {
+            queuedPacket.reset(av_packet_alloc());
+            av_packet_move_ref(queuedPacket.get(), packet);
+        }
+        return packetQueue.push(std::move(queuedPacket));
+    };
+    if (demuxKeyframePackets(formatContext, videoStreamIndex, options, resumePoint, queuePacket))
+        packetQueue.close();
+    else
+        fail();
+
+    decoder.join();
+    for (auto& analyzer : analyzers)
+        analyzer.join();
+    writer.join();
+
+    logging("Pipeline statistics:");
+    logQueueStatistics("Demux -> decode", packetQueue.statistics());
+    logQueueStatistics("Decode -> analyze", keyframeQueue.statistics());
+    logQueueStatistics("Analyze -> write", resultQueue.statistics());
+
+    return !failed;
+}
+
+static vector<KeyframeIndexEntry> keyframeIndex(AVStream* stream)
+{
+    vector<KeyframeIndexEntry> keyframes;
+
+    // The index entries were only made accessible through functions in later versions of FFmpeg.
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+    int entryCount = avformat_index_get_entries_count(stream);
+#else
+    int entryCount = stream->nb_index_entries;
+#endif
+    for (int i = 0; i < entryCount; ++i) {
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+        auto entry = avformat_index_get_entry(stream, i);
+#else
+        auto entry = &stream->index_entries[i];
+#endif
+        if (entry->flags & AVINDEX_KEYFRAME)
+            keyframes.push_back({ entry->pos, entry->timestamp });
+    }
+
+    return keyframes;
+}
+
+// Narrows the range of timestamps to analyze, in the stream's time base, to that of the shard given by the options. The
+// shards are split at the same timestamps whichever one is analyzed, so every keyframe is analyzed by exactly one
+// shard, even if the index times keyframes by decoding rather than presentation order.
+static bool restrictToShard(AVFormatContext* formatContext, int videoStreamIndex, const AnalyzerOptions& options, int64_t& startTimestamp, int64_t& endTimestamp)
+{
+    AVStream* stream = formatContext->streams[videoStreamIndex];
+    vector<KeyframeIndexEntry> keyframes = keyframeIndex(stream);
+    int64_t streamStart = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    int64_t duration = stream->duration;
+    if (duration == AV_NOPTS_VALUE && formatContext->duration != AV_NOPTS_VALUE)
+        duration = av_rescale_q(formatContext->duration, { 1, AV_TIME_BASE }, stream->time_base);
+
+    // Splitting at evenly spaced keyframes gives each shard the same amount of work, however the keyframes are spaced.
+    auto shardBoundary = [&](unsigned shard) {
+        if (!keyframes.empty())
+            return keyframes[static_cast<uint64_t>(shard) * keyframes.size() / options.shardCount].timestamp;
+        return streamStart + av_rescale(duration, shard, options.shardCount);
+    };
+
+    if (keyframes.empty() && (duration == AV_NOPTS_VALUE || duration <= 0)) {
+        logging(LogLevel::Error, "Error: Input file has neither a keyframe index nor a duration, so it can't be split into shards.");
+        return false;
+    }
+    if (keyframes.empty())
+        logging(LogLevel::Warning, "Warning: Input file has no keyframe index; splitting shards by duration.");
+
+    // The first shard has no start, and the last has no end, so that keyframes before the first indexed one, or after
+    // the duration, aren't missed.
+    if (options.shardIndex) {
+        int64_t shardStart = shardBoundary(options.shardIndex);
+        if (startTimestamp == AV_NOPTS_VALUE || startTimestamp < shardStart)
+            startTimestamp = shardStart;
+    }
+    if (options.shardIndex + 1 < options.shardCount) {
+        int64_t shardEnd = shardBoundary(options.shardIndex + 1);
+        if (endTimestamp == AV_NOPTS_VALUE || endTimestamp > shardEnd)
+            endTimestamp = shardEnd;
+    }
+
+    logging("Analyzing shard %u of %u.", options.shardIndex + 1, options.shardCount);
+    return true;
+}
+
+static const char* AVError(int errorCode)
+{
+    // Files may be analyzed on several threads at once, so each thread has its own buffer.
+    static thread_local char errorString[AV_ERROR_MAX_STRING_SIZE];
+    av_make_error_string(errorString, AV_ERROR_MAX_STRING_SIZE, errorCode);
+    return errorString;
+}
+
+static void vlogging(LogLevel level, const char* fmt, va_list args)
+{
+    if (level > logLevel)
+        return;
+
+    char line[AsyncLogger::MaximumLineLength];
+    int length = vsnprintf(line, sizeof(line), fmt, args);
+    if (length < 0)
+        return;
+    length = std::min<int>(length, sizeof(line) - 1);
+
+    if (asyncLogger) {
+        asyncLogger->log(line, length);
+        return;
+    }
+
+    // Keep lines logged by different threads from being interleaved.
+    flockfile(stderr);
+    fwrite(line, 1, length, stderr);
+    fputc('\n', stderr);
+    funlockfile(stderr);
+}
+
+void logging(LogLevel level, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vlogging(level, fmt, args);
+    va_end(args);
+}
+
+void logging(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vlogging(LogLevel::Info, fmt, args);
+    va_end(args);
+}
+
+void setLogLevel(LogLevel level)
+{
+    logLevel = level;
+}
+
+void setAsyncLogger(AsyncLogger* logger)
+{
+    asyncLogger = logger;
+}
+
+void setPerformanceStatistics(PerformanceStatistics* statistics)
+{
+    performanceStatistics = statistics;
+}
+
+void setImageExporter(ImageExporter* exporter)
+{
+    imageExporter = exporter;
+}
+
+const size_t AsyncLogger::MaximumLineLength;
+
+AsyncLogger::AsyncLogger()
+    : m_slots(new Slot[SlotCount])
+{
+    for (size_t i = 0; i < SlotCount; ++i)
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    m_thread = std::thread([this] { run(); });
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    m_stopping.store(true, std::memory_order_release);
+    m_wakeCondition.notify_one();
+    m_thread.join();
+}
+
+void AsyncLogger::log(const char* line, size_t length)
+{
+    // Claim the next slot. If it hasn't been written out since the last time around the ring, the buffer is full.
+    size_t position = m_enqueuePosition.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &m_slots[position % SlotCount];
+        auto difference = static_cast<intptr_t>(slot->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(position);
+        if (!difference) {
+            if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        } else {
+            if (difference < 0)
+                std::this_thread::yield();
+            position = m_enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->length = std::min(length, MaximumLineLength);
+    memcpy(slot->line, line, slot->length);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    m_wakeCondition.notify_one();
+}
+
+void AsyncLogger::run()
+{
+    string output;
+    while (true) {
+        bool stopping = m_stopping.load(std::memory_order_acquire);
+
+        while (true) {
+            Slot& slot = m_slots[m_dequeuePosition % SlotCount];
+            if (slot.sequence.load(std::memory_order_acquire) != m_dequeuePosition + 1)
+                break;
+            output.append(slot.line, slot.length);
+            output.push_back('\n');
+            slot.sequence.store(m_dequeuePosition + SlotCount, std::memory_order_release);
+            ++m_dequeuePosition;
+        }
+
+        if (!output.empty()) {
+            fwrite(output.data(), 1, output.size(), stderr);
+            output.clear();
+            continue;
+        }
+
+        if (stopping)
+            return;
+
+        // Producers notify without holding the lock, so a wakeup can be missed; the timeout bounds how long a line can
+        // wait to be written when that happens.
+        std::unique_lock<std::mutex> lock(m_wakeLock);
+        m_wakeCondition.wait_for(lock, std::chrono::milliseconds(10));
+    }
+}
+
+// Returns true if the first plane of frames in this format is an 8-bit luma plane that can be analyzed in place. This
+// is the case for planar and semi-planar YUV formats like yuv420p, yuvj420p, nv12, yuv422p and yuv444p, as well as for
+// gray8.
+static bool hasDirectLumaPlane(AVPixelFormat format)
+{
+    auto descriptor = av_pix_fmt_desc_get(format);
+    if (!descriptor || (descriptor->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)))
+        return false;
+
+    auto& luma = descriptor->comp[0];
+    return luma.plane == 0 && luma.step == 1 && luma.offset == 0 && luma.shift == 0 && luma.depth == 8;
+}
+
+// Returns true if the first plane of frames in this format is a little-endian luma plane with 9 to 16 bits per
+// sample, such as yuv420p10le or p010le. These can be reduced to GRAY8 by shifting, without calling sws_scale.
+static bool hasHighBitDepthLumaPlane(AVPixelFormat format)
+{
+    auto descriptor = av_pix_fmt_desc_get(format);
+    if (!descriptor || (descriptor->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BE)))
+        return false;
+
+    auto& luma = descriptor->comp[0];
+    return luma.plane == 0 && luma.step == 2 && luma.offset == 0 && luma.depth > 8 && luma.depth + luma.shift <= 16;
+}
+
+// Returns the gray format whose only plane is laid out like the luma plane of frames in this format, or AV_PIX_FMT_NONE
+// if there isn't one. Formats like p010 store samples in the high bits of each 16-bit word, so their most significant
+// bits are those of 16-bit samples.
+static AVPixelFormat lumaPlaneFormat(AVPixelFormat format)
+{
+    if (hasDirectLumaPlane(format))
+        return AV_PIX_FMT_GRAY8;
+    if (!hasHighBitDepthLumaPlane(format))
+        return AV_PIX_FMT_NONE;
+
+    auto& luma = av_pix_fmt_desc_get(format)->comp[0];
+    if (luma.depth + luma.shift == 16)
+        return AV_PIX_FMT_GRAY16LE;
+    switch (luma.depth) {
+    case 9:
+        return AV_PIX_FMT_GRAY9LE;
+    case 10:
+        return AV_PIX_FMT_GRAY10LE;
+    case 12:
+        return AV_PIX_FMT_GRAY12LE;
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+// Keeps the most significant 8 bits of each luma sample. Some formats, like p010, store samples in the high bits of
+// each 16-bit word; the component's shift accounts for this.
+static void copyHighBitDepthLuma(const AVFrame* frame, AVFrame* frameGrayscale)
+{
+    auto& luma = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format))->comp[0];
+    unsigned shift = luma.shift + luma.depth - 8;
+
+    for (int y = 0; y < frame->height; ++y) {
+        auto source = reinterpret_cast<const uint16_t*>(&frame->data[0][y * frame->linesize[0]]);
+        auto dest = &frameGrayscale->data[0][y * frameGrayscale->linesize[0]];
+        for (int x = 0; x < frame->width; ++x)
+            dest[x] = source[x] >> shift;
+    }
+}
+
+// Returns true if the luma of the frame is full range, from 0 to the maximum code value, rather than limited range,
+// from 16 to 235 shifted up to its bit depth. Unless the options say which it is, this is taken from the frame's color
+// range, or if that's unspecified, from its format: swscale treats yuvj formats and gray formats as full range.
+static bool hasFullRangeLuma(const AVFrame* frame, const AnalyzerOptions& options)
+{
+    if (options.lumaRange != LumaRange::Auto)
+        return options.lumaRange == LumaRange::Full;
+    if (frame->color_range != AVCOL_RANGE_UNSPECIFIED)
+        return frame->color_range == AVCOL_RANGE_JPEG;
+
+    auto descriptor = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    return descriptor && (descriptor->nb_components <= 2 || !strncmp(descriptor->name, "yuvj", 4));
+}
+
+// Fills values with the full range 8-bit luma of each code value of a luma plane with the given bit depth: its most
+// significant 8 bits, expanded from 16 to 235 to 0 to 255 if it's limited range. The expanded values are rounded the
+// same way swscale rounds them, so analyzing a luma plane through these values gives exactly the medians of the GRAY8
+// frame swscale would convert it to.
+static void eightBitLumaValues(unsigned depth, bool isFullRange, vector<float>& values)
+{
+    values.resize(1u << depth);
+    for (unsigned code = 0; code < values.size(); ++code) {
+        float value = code >> (depth - 8);
+        if (!isFullRange)
+            value = std::min(std::max(std::floor((value - 16) * 255 / 219 + 0.5f), 0.0f), 255.0f);
+        values[code] = value;
+    }
+}
+
+// Computes the cell medians of a frame's 8-bit luma plane. If lumaValues isn't null, each code value is counted as the
+// value it maps to.
+static bool analyzeLumaFrame(const AVFrame* frame, const AnalyzerOptions& options, const float* lumaValues, CellMedians& cellMedians)
+{
+    unsigned cellCount = 0;
+    for (auto& grid : options.grids)
+        cellCount += grid.cellCount();
+    cellMedians.resize(cellCount);
+
+    StageTimer timer(Stage::Analyze);
+    if (options.grids.size() == 1)
+        return analyzeGrayscaleFrame(frame, options.grids[0], lumaValues, cellMedians.data());
+    return analyzeGrayscaleFrameWithGrids(frame, options.grids, lumaValues, cellMedians.data());
+}
+
+AVFramePtr GrayscaleConverter::acquireFrame(int width, int height)
+{
+    if (!m_framePool.empty()) {
+        if (m_framePool.back()->width == width && m_framePool.back()->height == height) {
+            AVFramePtr frame = std::move(m_framePool.back());
+            m_framePool.pop_back();
+            return frame;
+        }
+
+        // The stream has changed resolution, so none of the pooled frames are usable.
+        m_framePool.clear();
+    }
+
+    AVFramePtr frame(av_frame_alloc());
+    frame->format = AV_PIX_FMT_GRAY8;
+    frame->width = width;
+    frame->height = height;
+    int result = av_frame_get_buffer(frame.get(), 32);
+    if (result < 0) {
+        logging(LogLevel::Error, "Error: Failed to allocate grayscale image for frame: %s", AVError(result));
+        return nullptr;
+    }
+
+    return frame;
+}
+
+void GrayscaleConverter::recycleFrame(AVFramePtr frame)
+{
+    // The image exporter may still hold a reference to the frame's buffer, in which case it can't be reused.
+    if (m_framePool.size() < GrayscaleFramePoolSize && av_frame_is_writable(frame.get()))
+        m_framePool.push_back(std::move(frame));
+}
+
+AVFramePtr GrayscaleConverter::convert(const AVFrame* frame)
+{
+    return convert(frame, frame->width, frame->height, GrayscaleConversionFlags);
+}
+
+AVFramePtr GrayscaleConverter::convert(const AVFrame* frame, int destWidth, int destHeight, int scalingFlags)
+{
+    StageTimer timer(Stage::Convert);
+    auto srcFormat = static_cast<AVPixelFormat>(frame->format);
+    bool isScaling = destWidth != frame->width || destHeight != frame->height;
+    if (!isScaling && hasHighBitDepthLumaPlane(srcFormat)) {
+        AVFramePtr frameGrayscale = acquireFrame(destWidth, destHeight);
+        if (!frameGrayscale)
+            return nullptr;
+
+        frameGrayscale->best_effort_timestamp = frame->best_effort_timestamp;
+        copyHighBitDepthLuma(frame, frameGrayscale.get());
+        return frameGrayscale;
+    }
+
+    // Formats without a luma plane, like RGB, need to be converted, as do frames that are being scaled.
+    return scale(frame, srcFormat, destWidth, destHeight, scalingFlags);
+}
+
+AVFramePtr GrayscaleConverter::scaleLuma(const AVFrame* frame, int destWidth, int destHeight, int scalingFlags)
+{
+    StageTimer timer(Stage::Convert);
+    AVPixelFormat lumaFormat = lumaPlaneFormat(static_cast<AVPixelFormat>(frame->format));
+    if (lumaFormat == AV_PIX_FMT_NONE)
+        return nullptr;
+
+    // swscale treats gray formats as full range, so scaling the luma plane as a gray frame leaves its values alone.
+    return scale(frame, lumaFormat, destWidth, destHeight, scalingFlags);
+}
+
+AVFramePtr GrayscaleConverter::expandLuma(const AVFrame* frame, bool isFullRange)
+{
+    StageTimer timer(Stage::Convert);
+    auto format = static_cast<AVPixelFormat>(frame->format);
+    if (lumaPlaneFormat(format) == AV_PIX_FMT_NONE)
+        return nullptr;
+
+    AVFramePtr frameGrayscale = acquireFrame(frame->width, frame->height);
+    if (!frameGrayscale)
+        return nullptr;
+
+    frameGrayscale->best_effort_timestamp = frame->best_effort_timestamp;
+    eightBitLumaValues(lumaBitDepth(format), isFullRange, m_lumaValues);
+    auto& luma = av_pix_fmt_desc_get(format)->comp[0];
+    unsigned mask = m_lumaValues.size() - 1;
+    for (int y = 0; y < frame->height; ++y) {
+        auto source = &frame->data[0][y * frame->linesize[0]];
+        auto dest = &frameGrayscale->data[0][y * frameGrayscale->linesize[0]];
+        if (luma.depth == 8) {
+            for (int x = 0; x < frame->width; ++x)
+                dest[x] = m_lumaValues[source[x]];
+        } else {
+            auto samples = reinterpret_cast<const uint16_t*>(source);
+            for (int x = 0; x < frame->width; ++x)
+                dest[x] = m_lumaValues[(samples[x] >> luma.shift) & mask];
+        }
+    }
+    return frameGrayscale;
+}
+
+// Scales the frame to a GRAY8 frame of the given size, reading its planes as if it were in srcFormat.
+AVFramePtr GrayscaleConverter::scale(const AVFrame* frame, AVPixelFormat srcFormat, int destWidth, int destHeight, int scalingFlags)
+{
+    int width = frame->width;
+    int height = frame->height;
+    AVFramePtr frameGrayscale = acquireFrame(destWidth, destHeight);
+    if (!frameGrayscale)
+        return nullptr;
+
+    frameGrayscale->best_effort_timestamp = frame->best_effort_timestamp;
+
+    // sws_getCachedContext returns the existing context if its parameters match, and otherwise frees it and creates a
+    // new one.
+    auto destFormat = AV_PIX_FMT_GRAY8;
+    m_conversionContext.reset(sws_getCachedContext(m_conversionContext.release(), width, height, srcFormat, destWidth, destHeight, destFormat, scalingFlags, nullptr, nullptr, nullptr));
+    if (!m_conversionContext) {
+        logging(LogLevel::Error, "Error: Failed to create a conversion context for pixel format %s.", av_get_pix_fmt_name(srcFormat));
+        return nullptr;
+    }
+
+    int startRow = 0;
+    int rowCount = height;
+    sws_scale(m_conversionContext.get(), frame->data, frame->linesize, startRow, rowCount, frameGrayscale->data, frameGrayscale->linesize);
+
+    return frameGrayscale;
+}
+
+// Computes the cell medians of a keyframe's full range 8-bit luma.
+static bool analyzeFullResolutionKeyframe(const AVFrame* frame, int keyframeNumber, const AnalyzerOptions& options, bool outputImage, AnalysisState& analysisState, CellMedians& cellMedians)
+{
+    // For YUV formats, the first plane of the decoded frame already holds the 8-bit luma we want, so analyze it
+    // directly rather than converting it to a GRAY8 copy. Limited range luma is expanded to full range as its
+    // histograms are reduced to medians, as swscale would when converting it.
+    auto format = static_cast<AVPixelFormat>(frame->format);
+    bool hasLumaPlane = hasDirectLumaPlane(format) || hasHighBitDepthLumaPlane(format);
+    if (hasLumaPlane)
+        eightBitLumaValues(8, hasFullRangeLuma(frame, options), analysisState.lumaValues);
+    if (hasDirectLumaPlane(format)) {
+        if (outputImage && !exportKeyframeImage(frame, keyframeNumber, options, analysisState))
+            return false;
+        return analyzeLumaFrame(frame, options, analysisState.lumaValues.data(), cellMedians);
+    }
+
+    // High bit depth luma is only shifted to 8 bits, so it's expanded in the same way; other formats are converted
+    // to full range GRAY8 by swscale. Either way, the converted frame is the keyframe's image if it's full range.
+    auto& grayscaleConverter = analysisState.grayscaleConverter;
+    AVFramePtr frameGrayscale = grayscaleConverter.convert(frame);
+    if (!frameGrayscale)
+        return false;
+
+    const AVFrame* image = !hasLumaPlane || hasFullRangeLuma(frame, options) ? frameGrayscale.get() : nullptr;
+    bool analysisSucceeded = !outputImage || exportKeyframeImage(frame, keyframeNumber, options, analysisState, image);
+    if (analysisSucceeded)
+        analysisSucceeded = analyzeLumaFrame(frameGrayscale.get(), options, hasLumaPlane ? analysisState.lumaValues.data() : nullptr, cellMedians);
+    grayscaleConverter.recycleFrame(std::move(frameGrayscale));
+
+    return analysisSucceeded;
+}
+
+// If one of the downscaled analysis modes is enabled, returns true along with the size keyframes should be reduced to.
+static bool reducedAnalysisSize(const AnalyzerOptions& options, int width, int height, int& reducedWidth, int& reducedHeight)
+{
+    if (options.sampleStride > 1) {
+        reducedWidth = (width + options.sampleStride - 1) / options.sampleStride;
+        reducedHeight = (height + options.sampleStride - 1) / options.sampleStride;
+    } else if (options.analysisWidth) {
+        reducedWidth = std::min<int>(width, options.analysisWidth);
+        reducedHeight = std::min<int>(height, options.analysisHeight);
+    } else
+        return false;
+
+    // Every cell of every grid still needs at least one pixel.
+    for (auto& grid : options.grids) {
+        reducedWidth = std::max<int>(reducedWidth, grid.columns);
+        reducedHeight = std::max<int>(reducedHeight, grid.rows);
+    }
+
+    return reducedWidth != width || reducedHeight != height;
+}
+
+// Computes the medians of one grid's cells directly from a luma plane of Samples, with a histogram bin for every code
+// value: 256 for 8-bit video, 1024 for 10-bit, and 4096 for 12-bit. Only every stride-th sample of every stride-th row
+// is counted, as long as every cell still has at least one. If lumaValues isn't null, each code value is counted as the
+// value it maps to.
+template<typename Sample>
+static void analyzeStridedLumaGrid(const AVFrame* frame, const Grid& grid, unsigned stride, const float* lumaValues, vector<uint32_t>& histograms, float* cellMedians)
+{
+    auto& luma = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format))->comp[0];
+    unsigned binCount = 1u << luma.depth;
+    unsigned mask = binCount - 1;
+    stride = std::max(1u, std::min({ stride, frame->width / grid.columns, frame->height / grid.rows }));
+
+    // Each thread reuses the boundaries' buffers, so that they're only allocated once.
+    static thread_local vector<unsigned> columnStarts;
+    static thread_local vector<unsigned> rowStarts;
+    cellBoundaries((frame->width + stride - 1) / stride, grid.columns, columnStarts);
+    cellBoundaries((frame->height + stride - 1) / stride, grid.rows, rowStarts);
+    histograms.resize(grid.columns * binCount);
+    for (unsigned y = 0; y < grid.rows; ++y) {
+        std::fill(histograms.begin(), histograms.end(), 0);
+        for (unsigned row = rowStarts[y]; row < rowStarts[y + 1]; ++row) {
+            // Some formats, like p010, store samples in the high bits of each 16-bit word; the component's shift
+            // accounts for this. Masking keeps stray high bits from indexing past the histogram.
+            auto samples = reinterpret_cast<const Sample*>(&frame->data[0][row * stride * frame->linesize[0]]);
+            for (unsigned x = 0; x < grid.columns; ++x) {
+                uint32_t* histogram = &histograms[x * binCount];
+                for (unsigned column = columnStarts[x]; column < columnStarts[x + 1]; ++column)
+                    ++histogram[(samples[column * stride] >> luma.shift) & mask];
+            }
+        }
+
+        unsigned yPixels = rowStarts[y + 1] - rowStarts[y];
+        for (unsigned x = 0; x < grid.columns; ++x)
+            cellMedians[y * grid.columns + x] = histogramMedian(&histograms[x * binCount], (columnStarts[x + 1] - columnStarts[x]) * yPixels, lumaValues);
+    }
+}
+
+// Computes the cell medians of every grid from every stride-th sample of every stride-th row of a frame's luma plane,
+// which must be one of those hasDirectLumaPlane() or hasHighBitDepthLumaPlane() accepts.
+static void analyzeStridedLuma(const AVFrame* frame, const AnalyzerOptions& options, unsigned stride, const float* lumaValues, vector<uint32_t>& histograms, CellMedians& cellMedians)
+{
+    StageTimer timer(Stage::Analyze);
+    unsigned cellCount = 0;
+    for (auto& grid : options.grids)
+        cellCount += grid.cellCount();
+    cellMedians.resize(cellCount);
+
+    bool isEightBit = hasDirectLumaPlane(static_cast<AVPixelFormat>(frame->format));
+    float* gridMedians = cellMedians.data();
+    for (auto& grid : options.grids) {
+        if (isEightBit)
+            analyzeStridedLumaGrid<uint8_t>(frame, grid, stride, lumaValues, histograms, gridMedians);
+        else
+            analyzeStridedLumaGrid<uint16_t>(frame, grid, stride, lumaValues, histograms, gridMedians);
+        gridMedians += grid.cellCount();
+    }
+}
+
+// Hands the keyframe to the image exporter, if there is one, as a full range 8-bit grayscale image, like the GRAY8
+// frame swscale would convert it to. If convertedFrame isn't null, it's that image already, and it's exported instead.
+static bool exportKeyframeImage(const AVFrame* frame, int keyframeNumber, const AnalyzerOptions& options, AnalysisState& analysisState, const AVFrame* convertedFrame)
+{
+    if (!imageExporter)
+        return true;
+
+    string name = analysisState.keyframeImagePrefix + "frame-" + std::to_string(keyframeNumber);
+    if (convertedFrame)
+        return imageExporter->exportFrame(convertedFrame, name);
+
+    // A full range 8-bit luma plane is the image as it is. Other luma planes are expanded, or reduced to 8 bits, and
+    // other formats converted by swscale.
+    auto format = static_cast<AVPixelFormat>(frame->format);
+    bool isFullRange = hasFullRangeLuma(frame, options);
+    if (hasDirectLumaPlane(format) && isFullRange)
+        return imageExporter->exportFrame(frame, name);
+
+    auto& grayscaleConverter = analysisState.grayscaleConverter;
+    AVFramePtr frameGrayscale = lumaPlaneFormat(format) != AV_PIX_FMT_NONE ? grayscaleConverter.expandLuma(frame, isFullRange) : grayscaleConverter.convert(frame);
+    if (!frameGrayscale || !imageExporter->exportFrame(frameGrayscale.get(), name))
+        return false;
+    grayscaleConverter.recycleFrame(std::move(frameGrayscale));
+    return true;
+}
+
+// Computes the cell medians of every grid from a frame's luma plane, as code values at its own bit depth.
+static bool analyzeNativeDepthKeyframe(const AVFrame* frame, int keyframeNumber, const AnalyzerOptions& options, AnalysisState& analysisState, CellMedians& cellMedians)
+{
+    // Keyframe images are full range 8-bit, so they're exported from a GRAY8 copy.
+    if (!exportKeyframeImage(frame, keyframeNumber, options, analysisState))
+        return false;
+
+    // Every sample of an 8-bit luma plane is counted by the same histogram kernels as at the 8-bit scale, just without
+    // mapping code values to full range. Higher bit depths, and sampling every Nth pixel, need a bin per code value.
+    bool isEightBit = hasDirectLumaPlane(static_cast<AVPixelFormat>(frame->format));
+    if (isEightBit && options.sampleStride <= 1)
+        return analyzeLumaFrame(frame, options, nullptr, cellMedians);
+
+    analyzeStridedLuma(frame, options, options.sampleStride, nullptr, analysisState.stridedHistograms, cellMedians);
+    if (options.sampleStride > 1 && options.reportSamplingError) {
+        CellMedians exactMedians;
+        if (isEightBit) {
+            if (!analyzeLumaFrame(frame, options, nullptr, exactMedians))
+                return false;
+        } else
+            analyzeStridedLuma(frame, options, 1, nullptr, analysisState.stridedHistograms, exactMedians);
+        analysisState.samplingError.add(exactMedians, cellMedians);
+    }
+    return true;
+}
+
+// Returns the number of bits per luma sample of frames in this format, or 8 for formats without a luma plane, which
+// are converted to GRAY8.
+static unsigned lumaBitDepth(AVPixelFormat format)
+{
+    auto descriptor = av_pix_fmt_desc_get(format);
+    if (!descriptor || (descriptor->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL)))
+        return 8;
+    return descriptor->comp[0].depth;
+}
+
+// Converts medians to the scale given by the options, from code values of the frame's luma if areCodeValues is true, or
+// otherwise from full range 8-bit values, which are what the 8-bit analysis computes. Limited range black and white are
+// 16 and 235, shifted up to the bit depth; frames without luma, like RGB frames, are full range 8-bit. Normalized
+// medians aren't clamped, so those of cells that are mostly below black or above white, which limited range video can
+// have, are just outside 0 to 1.
+static void scaleMedians(const AVFrame* frame, bool areCodeValues, const AnalyzerOptions& options, CellMedians& cellMedians)
+{
+    auto format = static_cast<AVPixelFormat>(frame->format);
+    auto descriptor = av_pix_fmt_desc_get(format);
+    bool hasLuma = descriptor && !(descriptor->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL));
+    unsigned depth = lumaBitDepth(format);
+    bool isFullRange = !hasLuma || hasFullRangeLuma(frame, options);
+    float black = isFullRange ? 0 : 16u << (depth - 8);
+    float white = isFullRange ? (1u << depth) - 1 : 235u << (depth - 8);
+    if (!areCodeValues) {
+        if (options.lumaScale == LumaScale::Normalized) {
+            for (auto& median : cellMedians)
+                median /= 255;
+        } else {
+            for (auto& median : cellMedians)
+                median = black + median * (white - black) / 255;
+        }
+        return;
+    }
+
+    if (options.lumaScale == LumaScale::Normalized) {
+        for (auto& median : cellMedians)
+            median = (median - black) / (white - black);
+    }
+}
+
+// Computes the cell medians of a decoded keyframe, on the scale given by the options.
+static bool analyzeKeyframe(const AVFrame* frame, int keyframeNumber, const AnalyzerOptions& options, AnalysisState& analysisState, CellMedians& cellMedians)
+{
+    AVFramePtr softwareFrame;
+    if (frame->hw_frames_ctx) {
+        softwareFrame = downloadHardwareFrame(frame);
+        if (!softwareFrame)
+            return false;
+        frame = softwareFrame.get();
+    }
+
+    if (options.lumaScale == LumaScale::EightBit)
+        return analyzeEightBitKeyframe(frame, keyframeNumber, options, analysisState, cellMedians);
+
+    // Luma planes are analyzed as they are, so that native medians are exact code values. Other frames, and those
+    // reduced to a lower resolution, are analyzed as full range 8-bit luma.
+    auto format = static_cast<AVPixelFormat>(frame->format);
+    bool areCodeValues = (hasDirectLumaPlane(format) || hasHighBitDepthLumaPlane(format)) && !options.analysisWidth;
+    bool analysisSucceeded;
+    if (areCodeValues)
+        analysisSucceeded = analyzeNativeDepthKeyframe(frame, keyframeNumber, options, analysisState, cellMedians);
+    else
+        analysisSucceeded = analyzeEightBitKeyframe(frame, keyframeNumber, options, analysisState, cellMedians);
+
+    if (analysisSucceeded)
+        scaleMedians(frame, areCodeValues, options, cellMedians);
+    return analysisSucceeded;
+}
+
+// Computes the cell medians of a software keyframe from its 8-bit luma. The state's converter is used for frames that
+// need to be converted to GRAY8 or downscaled first; it may only be used by one thread at a time.
+static bool analyzeEightBitKeyframe(const AVFrame* frame, int keyframeNumber, const AnalyzerOptions& options, AnalysisState& analysisState, CellMedians& cellMedians)
+{
+    int reducedWidth;
+    int reducedHeight;
+    if (!reducedAnalysisSize(options, frame->width, frame->height, reducedWidth, reducedHeight))
+        return analyzeFullResolutionKeyframe(frame, keyframeNumber, options, true, analysisState, cellMedians);
+
+    // The downscaled medians are on the same scale as the exact ones: limited range luma is counted as the full range
+    // values it maps to, after being sampled or scaled in its own range.
+    auto format = static_cast<AVPixelFormat>(frame->format);
+    auto& grayscaleConverter = analysisState.grayscaleConverter;
+    bool isFullRange = hasFullRangeLuma(frame, options);
+    bool analysisSucceeded = true;
+
+    // The keyframe's image is still exported at full resolution.
+    if (!exportKeyframeImage(frame, keyframeNumber, options, analysisState))
+        return false;
+
+    if (options.sampleStride > 1 && (hasDirectLumaPlane(format) || hasHighBitDepthLumaPlane(format))) {
+        // Every Nth pixel of every Nth row can be counted straight from the luma plane, without touching the rest.
+        eightBitLumaValues(lumaBitDepth(format), isFullRange, analysisState.lumaValues);
+        analyzeStridedLuma(frame, options, options.sampleStride, analysisState.lumaValues.data(), analysisState.stridedHistograms, cellMedians);
+    } else {
+        // Let swscale shrink the frame, or just its luma plane if it has one, to a small GRAY8 image, which costs very
+        // little to reduce. Point sampling picks every Nth pixel of every Nth row; otherwise, area averaging gives a
+        // better approximation of the full frame.
+        int flags = options.sampleStride > 1 ? SWS_POINT : SWS_AREA;
+        bool isLumaPlane = lumaPlaneFormat(format) != AV_PIX_FMT_NONE;
+        AVFramePtr reducedFrame = isLumaPlane ? grayscaleConverter.scaleLuma(frame, reducedWidth, reducedHeight, flags) : grayscaleConverter.convert(frame, reducedWidth, reducedHeight, flags);
+        if (!reducedFrame)
+            return false;
+
+        eightBitLumaValues(8, isFullRange, analysisState.lumaValues);
+        analysisSucceeded = analyzeLumaFrame(reducedFrame.get(), options, isLumaPlane ? analysisState.lumaValues.data() : nullptr, cellMedians);
+        grayscaleConverter.recycleFrame(std::move(reducedFrame));
+    }
+    if (!analysisSucceeded || !options.reportSamplingError)
+        return analysisSucceeded;
+
+    CellMedians exactMedians;
+    if (!analyzeFullResolutionKeyframe(frame, keyframeNumber, options, false, analysisState, exactMedians))
+        return false;
+    analysisState.samplingError.add(exactMedians, cellMedians);
+
+    return true;
+}
+
+static bool processKeyframe(StreamAnalysis& streamAnalysis, AVFrame* frame)
+{
+    auto decodedTime = performanceStatistics ? PerformanceStatistics::Clock::now() : PerformanceStatistics::Clock::time_point();
+    int keyframeNumber = streamAnalysis.codecContext->frame_number;
+    logging(LogLevel::Verbose, "Processing keyframe %d pts %" PRId64 " dts %d...", keyframeNumber, frame->pts, frame->coded_picture_number);
+
+    auto& options = *streamAnalysis.options;
+    if (streamAnalysis.duplicateFilter.isCoarseDuplicate(frame, options))
+        return true;
+
+    auto& keyframe = streamAnalysis.keyframe;
+    keyframe.timestamp = frame->best_effort_timestamp;
+    keyframe.keyframeNumber = keyframeNumber;
+    if (!analyzeKeyframe(frame, keyframeNumber, options, streamAnalysis.analysisStates[0], keyframe.cellMedians))
+        return false;
+
+    return emitKeyframe(streamAnalysis, keyframe, decodedTime);
+}
+
+// Hands the analysis of a keyframe to the stream's keyframe handler, unless it's a near duplicate that's dropped.
+// Keyframes must be emitted in presentation order.
+static bool emitKeyframe(StreamAnalysis& streamAnalysis, KeyframeAnalysis& keyframe, PerformanceStatistics::Clock::time_point decodedTime)
+{
+    auto& options = *streamAnalysis.options;
+    keyframe.isDuplicate = streamAnalysis.duplicateFilter.isDuplicate(keyframe.cellMedians, options);
+    if ((!keyframe.isDuplicate || options.markDuplicates) && !(*streamAnalysis.handleKeyframe)(keyframe))
+        return false;
+
+    if (performanceStatistics)
+        performanceStatistics->addKeyframe(PerformanceStatistics::Clock::now() - decodedTime);
+    return true;
+}
+
+// Returns the median of the count values counted by histogram, which has a bin for each value. If values isn't null,
+// bin i counts values[i] instead of i; the values mustn't decrease from one bin to the next, so that sorting the bins
+// also sorts their values.
+static inline float histogramMedian(const uint32_t* histogram, unsigned count, const float* values)
+{
+    // Walk the cumulative counts to find the value of the middle element in sorted order.
+    unsigned middle = count / 2;
+    unsigned lowerCount = 0;
+    unsigned value = 0;
+    while (lowerCount + histogram[value] <= middle)
+        lowerCount += histogram[value++];
+    float median = values ? values[value] : value;
+
+    // For sets with an odd number of items, the median is the middle element.
+    if (count & 1)
+        return median;
+
+    // For sets with an even number of items, the median is the average of the middle two elements. If the element
+    // before the middle one falls in the same bin, they're equal; otherwise it's the largest value below this bin.
+    // FIXME: Although this gives the true median, it's probably unnecessarily precise. For our purposes, it's probably
+    // fine to just return the first value found above.
+    if (lowerCount < middle)
+        return median;
+
+    unsigned lowerValue = value - 1;
+    while (!histogram[lowerValue])
+        --lowerValue;
+    return (median + (values ? values[lowerValue] : lowerValue)) / 2;
+}
+
+// Returns the median of every CoarseSampleStride-th pixel of every CoarseSampleStride-th row of an 8-bit luma plane.
+// This touches a small fraction of the pixels that a full analysis does, so it's a cheap test of whether a keyframe
+// is worth analyzing.
+static float coarseLumaMedian(const AVFrame* frame)
+{
+    uint32_t histogram[256] = { };
+    unsigned count = 0;
+    for (int y = 0; y < frame->height; y += CoarseSampleStride) {
+        const uint8_t* row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x += CoarseSampleStride) {
+            ++histogram[row[x]];
+            ++count;
+        }
+    }
+    return histogramMedian(histogram, count);
+}
+
+bool DuplicateFilter::isDuplicate(const CellMedians& cellMedians, const AnalyzerOptions& options)
+{
+    if (options.duplicateThreshold < 0)
+        return false;
+
+    if (!lastMedians.empty()) {
+        float distance = 0;
+        for (size_t i = 0; i < cellMedians.size(); ++i) {
+            float difference = std::abs(cellMedians[i] - lastMedians[i]);
+            distance = options.duplicateMetric == DuplicateMetric::L1 ? distance + difference : std::max(distance, difference);
+        }
+        if (distance <= options.duplicateThreshold) {
+            ++duplicateCount;
+            return true;
+        }
+    }
+
+    lastMedians = cellMedians;
+    return false;
+}
+
+// Keyframes that don't have an 8-bit luma plane in system memory are always analyzed.
+bool DuplicateFilter::isCoarseDuplicate(const AVFrame* frame, const AnalyzerOptions& options)
+{
+    if (options.coarseDuplicateThreshold < 0 || frame->hw_frames_ctx || !hasDirectLumaPlane(static_cast<AVPixelFormat>(frame->format)))
+        return false;
+
+    StageTimer timer(Stage::Analyze);
+    float median = coarseLumaMedian(frame);
+    if (lastCoarseMedian >= 0 && std::abs(median - lastCoarseMedian) <= options.coarseDuplicateThreshold) {
+        ++coarseDuplicateCount;
+        return true;
+    }
+
+    lastCoarseMedian = median;
+    return false;
+}
+
+// The histogram for one cell. Its counts are spread across several sub-histograms, so that consecutive pixels with
+// the same value increment different counters, rather than each waiting on the store made by the one before it.
+static const unsigned SubHistogramCount = 4;
+struct CellHistogram {
+    uint32_t counts[SubHistogramCount][256];
+};
+
+static inline float cellHistogramMedian(const CellHistogram& histogram, unsigned count, const float* values)
+{
+    uint32_t merged[256];
+    for (unsigned value = 0; value < 256; ++value) {
+        merged[value] = 0;
+        for (unsigned i = 0; i < SubHistogramCount; ++i)
+            merged[value] += histogram.counts[i][value];
+    }
+
+    return histogramMedian(merged, count, values);
+}
+
+// A row histogram kernel adds the pixels of one row to the histograms of every cell in the row. Cell i spans the
+// columns [cellStarts[i], cellStarts[i + 1]). Each of the optimized kernels is a template on the number of cells, so
+// that for common grid sizes the loop over cells is unrolled; a CellCount of 0 takes the count from cellCount instead.
+using RowHistogramKernel = void (*)(const uint8_t* row, const unsigned* cellStarts, unsigned cellCount, CellHistogram* histograms);
+
+// The reference kernel, against which all other kernels are verified. It counts every pixel into the first
+// sub-histogram.
+static void accumulateRowReference(const uint8_t* row, const unsigned* cellStarts, unsigned cellCount, CellHistogram* histograms)
+{
+    for (unsigned cell = 0; cell < cellCount; ++cell) {
+        for (unsigned x = cellStarts[cell]; x < cellStarts[cell + 1]; ++x)
+            ++histograms[cell].counts[0][row[x]];
+    }
+}
+
+// Counts the four bytes of word into the four sub-histograms.
+static inline void accumulateWord(uint32_t word, CellHistogram& histogram)
+{
+    ++histogram.counts[0][word & 0xff];
+    ++histogram.counts[1][(word >> 8) & 0xff];
+    ++histogram.counts[2][(word >> 16) & 0xff];
+    ++histogram.counts[3][word >> 24];
+}
+
+static inline void accumulateSpan(const uint8_t* pixels, unsigned count, CellHistogram& histogram)
+{
+    unsigned i = 0;
+    for (; i + 4 <= count; i += 4) {
+        ++histogram.counts[0][pixels[i]];
+        ++histogram.counts[1][pixels[i + 1]];
+        ++histogram.counts[2][pixels[i + 2]];
+        ++histogram.counts[3][pixels[i + 3]];
+    }
+    for (; i < count; ++i)
+        ++histogram.counts[0][pixels[i]];
+}
+
+template<unsigned CellCount>
+static void accumulateRowScalar(const uint8_t* row, const unsigned* cellStarts, unsigned cellCount, CellHistogram* histograms)
+{
+    const unsigned count = CellCount ? CellCount : cellCount;
+    for (unsigned cell = 0; cell < count; ++cell)
+        accumulateSpan(&row[cellStarts[cell]], cellStarts[cell + 1] - cellStarts[cell], histograms[cell]);
+}
+
+// The vectorized kernels can't make the counting itself parallel, but they load a block of pixels at a time and count
+// blocks where every pixel has the same value, like letterboxing and flat backgrounds, with a single add.
+#if HAVE_X86_HISTOGRAM_KERNELS
+__attribute__((target("sse4.1")))
+static inline void accumulateBlock(__m128i pixels, CellHistogram& histogram)
+{
+    accumulateWord(_mm_cvtsi128_si32(pixels), histogram);
+    accumulateWord(_mm_extract_epi32(pixels, 1), histogram);
+    accumulateWord(_mm_extract_epi32(pixels, 2), histogram);
+    accumulateWord(_mm_extract_epi32(pixels, 3), histogram);
+}
+
+template<unsigned CellCount>
+__attribute__((target("sse4.1")))
+static void accumulateRowSSE41(const uint8_t* row, const unsigned* cellStarts, unsigned cellCount, CellHistogram* histograms)
+{
+    const unsigned count = CellCount ? CellCount : cellCount;
+    for (unsigned cell = 0; cell < count; ++cell) {
+        auto& histogram = histograms[cell];
+        unsigned x = cellStarts[cell];
+        unsigned end = cellStarts[cell + 1];
+        for (; x + 16 <= end; x += 16) {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&row[x]));
+            __m128i first = _mm_shuffle_epi8(pixels, _mm_setzero_si128());
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, first)) == 0xffff) {
+                histogram.counts[0][row[x]] += 16;
+                continue;
+            }
+            accumulateBlock(pixels, histogram);
+        }
+        accumulateSpan(&row[x], end - x, histogram);
+    }
+}
+
+template<unsigned CellCount>
+__attribute__((target("avx2")))
+static void accumulateRowAVX2(const uint8_t* row, const unsigned* cellStarts, unsigned cellCount, CellHistogram* histograms)
+{
+    const unsigned count = CellCount ? CellCount : cellCount;
+    for (unsigned cell = 0; cell < count; ++cell) {
+        auto& histogram = histograms[cell];
+        unsigned x = cellStarts[cell];
+        unsigned end = cellStarts[cell + 1];
+        for (; x + 32 <= end; x += 32) {
+            __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&row[x]));
+            __m256i first = _mm256_broadcastb_epi8(_mm256_castsi256_si128(pixels));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(pixels, first)) == -1) {
+                histogram.counts[0][row[x]] += 32;
+                continue;
+            }
+            accumulateBlock(_mm256_castsi256_si128(pixels), histogram);
+            accumulateBlock(_mm256_extracti128_si256(pixels, 1), histogram);
+        }
+        accumulateSpan(&row[x], end - x, histogram);
+    }
+}
+#endif
+
+#if HAVE_NEON_HISTOGRAM_KERNELS
+template<unsigned CellCount>
+static void accumulateRowNEON(const uint8_t* row, const unsigned* cellStarts, unsigned cellCount, CellHistogram* histograms)
+{
+    const unsigned count = CellCount ? CellCount : cellCount;
+    for (unsigned cell = 0; cell < count; ++cell) {
+        auto& histogram = histograms[cell];
+        unsigned x = cellStarts[cell];
+        unsigned end = cellStarts[cell + 1];
+        for (; x + 16 <= end; x += 16) {
+            uint8x16_t pixels = vld1q_u8(&row[x]);
+            if (vminvq_u8(vceqq_u8(pixels, vdupq_n_u8(row[x]))) == 0xff) {
+                histogram.counts[0][row[x]] += 16;
+                continue;
+            }
+            uint32x4_t words = vreinterpretq_u32_u8(pixels);
+            accumulateWord(vgetq_lane_u32(words, 0), histogram);
+            accumulateWord(vgetq_lane_u32(words, 1), histogram);
+            accumulateWord(vgetq_lane_u32(words, 2), histogram);
+            accumulateWord(vgetq_lane_u32(words, 3), histogram);
+        }
+        accumulateSpan(&row[x], end - x, histogram);
+    }
+}
+#endif
+
+enum class HistogramKernelType { Scalar, SSE41, AVX2, NEON };
+
+// Picks the fastest kernel supported by the CPU we're running on, so that a single binary can use AVX2 where it's
+// available without requiring it everywhere.
+static HistogramKernelType detectHistogramKernelType()
+{
+#if HAVE_X86_HISTOGRAM_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        logging("Using AVX2 histogram kernel.");
+        return HistogramKernelType::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        logging("Using SSE4.1 histogram kernel.");
+        return HistogramKernelType::SSE41;
+    }
+#elif HAVE_NEON_HISTOGRAM_KERNELS
+    // Advanced SIMD is a mandatory part of AArch64.
+    logging("Using NEON histogram kernel.");
+    return HistogramKernelType::NEON;
+#endif
+    logging("Using scalar histogram kernel.");
+    return HistogramKernelType::Scalar;
+}
+
+// The CPU is only inspected once, no matter how many grid sizes are used.
+static HistogramKernelType histogramKernelType()
+{
+    static const HistogramKernelType kernelType = detectHistogramKernelType();
+    return kernelType;
+}
+
+template<unsigned CellCount>
+static RowHistogramKernel selectRowHistogramKernel()
+{
+    switch (histogramKernelType()) {
+#if HAVE_X86_HISTOGRAM_KERNELS
+    case HistogramKernelType::AVX2:
+        return accumulateRowAVX2<CellCount>;
+    case HistogramKernelType::SSE41:
+        return accumulateRowSSE41<CellCount>;
+#endif
+#if HAVE_NEON_HISTOGRAM_KERNELS
+    case HistogramKernelType::NEON:
+        return accumulateRowNEON<CellCount>;
+#endif
+    default:
+        return accumulateRowScalar<CellCount>;
+    }
+}
+
+// Runs the reference kernel over the same rows and compares the merged counts, returning false if they differ. The
+// self-test checks each kernel with this.
+static bool verifyCellHistograms(const uint8_t* data, int lineSize, unsigned yOffset, unsigned yPixels, const unsigned* cellStarts, unsigned cellCount, const CellHistogram* histograms)
+{
+    vector<CellHistogram> referenceHistograms(cellCount);
+    memset(referenceHistograms.data(), 0, referenceHistograms.size() * sizeof(CellHistogram));
+    for (unsigned y = 0; y < yPixels; ++y)
+        accumulateRowReference(&data[(yOffset + y) * lineSize], cellStarts, cellCount, referenceHistograms.data());
+
+    for (unsigned cell = 0; cell < cellCount; ++cell) {
+        for (unsigned value = 0; value < 256; ++value) {
+            uint32_t count = 0;
+            for (unsigned i = 0; i < SubHistogramCount; ++i)
+                count += histograms[cell].counts[i][value];
+            if (count != referenceHistograms[cell].counts[0][value])
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static const char* StageNames[StageCount] = { "read", "send_packet", "receive_frame", "convert", "analyze", "write" };
+
+void PerformanceStatistics::addKeyframe(Clock::duration latency)
+{
+    std::lock_guard<std::mutex> lock(m_latencyLock);
+    m_keyframeLatencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+}
+
+double PerformanceStatistics::latencyPercentile(const vector<int64_t>& sortedLatencies, unsigned percentile)
+{
+    if (sortedLatencies.empty())
+        return 0;
+
+    // Use the nearest rank, so that the result is always one of the measured latencies.
+    size_t rank = (sortedLatencies.size() * percentile + 99) / 100;
+    return sortedLatencies[std::max<size_t>(rank, 1) - 1] / 1e6;
+}
+
+void PerformanceStatistics::logSummary() const
+{
+    vector<int64_t> latencies;
+    {
+        std::lock_guard<std::mutex> lock(m_latencyLock);
+        latencies = m_keyframeLatencies;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    logging("Statistics:");
+    for (size_t i = 0; i < StageCount; ++i) {
+        uint64_t calls = m_stageCalls[i];
+        double milliseconds = m_stageNanoseconds[i] / 1e6;
+        logging("    %-13s %10.1f ms in %" PRIu64 " calls, %.3f ms each", StageNames[i], milliseconds, calls, calls ? milliseconds / calls : 0.0);
+    }
+    logging("    %" PRIu64 " bytes read, %" PRIu64 " video packets read, %" PRIu64 " decoded, %zu keyframes",
+        m_bytesRead.load(), m_packetsRead.load(), m_packetsDecoded.load(), latencies.size());
+    logging("    Keyframe latency: p50 %.3f ms, p99 %.3f ms", latencyPercentile(latencies, 50), latencyPercentile(latencies, 99));
+    double seconds = std::chrono::duration<double>(Clock::now() - m_startTime).count();
+    logging("    %.2f s elapsed, %.1f keyframes/s", seconds, latencies.size() / seconds);
+}
+
+bool PerformanceStatistics::writeJSON(const char* filename) const
+{
+    vector<int64_t> latencies;
+    {
+        std::lock_guard<std::mutex> lock(m_latencyLock);
+        latencies = m_keyframeLatencies;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        logging(LogLevel::Error, "Error: Failed to open statistics file %s: %s", filename, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "{\n    \"stages\": {\n");
+    for (size_t i = 0; i < StageCount; ++i) {
+        fprintf(file, "        \"%s\": { \"calls\": %" PRIu64 ", \"milliseconds\": %.3f }%s\n", StageNames[i],
+            m_stageCalls[i].load(), m_stageNanoseconds[i] / 1e6, i + 1 < StageCount ? "," : "");
+    }
+    fprintf(file, "    },\n");
+    fprintf(file, "    \"bytes_read\": %" PRIu64 ",\n", m_bytesRead.load());
+    fprintf(file, "    \"packets_read\": %" PRIu64 ",\n", m_packetsRead.load());
+    fprintf(file, "    \"packets_decoded\": %" PRIu64 ",\n", m_packetsDecoded.load());
+    fprintf(file, "    \"keyframes\": %zu,\n", latencies.size());
+    fprintf(file, "    \"keyframe_latency_p50_ms\": %.3f,\n", latencyPercentile(latencies, 50));
+    fprintf(file, "    \"keyframe_latency_p99_ms\": %.3f,\n", latencyPercentile(latencies, 99));
+    double seconds = std::chrono::duration<double>(Clock::now() - m_startTime).count();
+    fprintf(file, "    \"elapsed_seconds\": %.3f,\n", seconds);
+    fprintf(file, "    \"keyframes_per_second\": %.2f\n", latencies.size() / seconds);
+    fprintf(file, "}\n");
+
+    if (fclose(file)) {
+        logging(LogLevel::Error, "Error: Failed to write statistics file %s: %s", filename, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+InputReader::~InputReader()
+{
+    if (m_ioContext) {
+        // The buffer may have been reallocated by FFmpeg, so free the one the context currently holds.
+        av_freep(&m_ioContext->buffer);
+        avio_context_free(&m_ioContext);
+    }
+    avio_closep(&m_source);
+}
+
+bool InputReader::open(const char* input, int bufferSize)
+{
+    // FFmpeg's pipe protocol reads from a file descriptor; pipe:0 is stdin.
+    if (!strcmp(input, "-"))
+        input = "pipe:0";
+
+    // Keep HTTP connections open across seeks, rather than reconnecting for each range.
+    AVDictionary* protocolOptions = nullptr;
+    av_dict_set(&protocolOptions, "multiple_requests", "1", 0);
+    int result = avio_open2(&m_source, input, AVIO_FLAG_READ, nullptr, &protocolOptions);
+    av_dict_free(&protocolOptions);
+    if (result < 0) {
+        logging(LogLevel::Error, "Error: Failed to open input file: %s", AVError(result));
+        return false;
+    }
+
+    auto buffer = static_cast<unsigned char*>(av_malloc(bufferSize));
+    if (!buffer) {
+        logging(LogLevel::Error, "Error: Failed to allocate read buffer.");
+        return false;
+    }
+
+    m_ioContext = avio_alloc_context(buffer, bufferSize, 0, this, read, nullptr, m_source->seekable ? seek : nullptr);
+    if (!m_ioContext) {
+        av_free(buffer);
+        logging(LogLevel::Error, "Error: Failed to allocate I/O context.");
+        return false;
+    }
+    m_ioContext->seekable = m_source->seekable;
+
+    return true;
+}
+
+int InputReader::read(void* opaque, uint8_t* buffer, int size)
+{
+    // avio_read bypasses the source's own, smaller, buffer for reads this large.
+    int result = avio_read(static_cast<InputReader*>(opaque)->m_source, buffer, size);
+    if (result > 0 && performanceStatistics)
+        performanceStatistics->addBytesRead(result);
+    return result ? result : AVERROR_EOF;
+}
+
+int64_t InputReader::seek(void* opaque, int64_t offset, int whence)
+{
+    auto source = static_cast<InputReader*>(opaque)->m_source;
+    if (whence & AVSEEK_SIZE)
+        return avio_size(source);
+    return avio_seek(source, offset, whence & ~AVSEEK_FORCE);
+}
+
+FrameAnalysisWriter::~FrameAnalysisWriter()
+{
+    // If the writer was never committed, don't leave a partial file behind, unless it can be resumed from.
+    if (m_fileDescriptor != -1) {
+        if (m_flushesEveryRow)
+            flush();
+        close(m_fileDescriptor);
+        if (!m_flushesEveryRow)
+            unlink(m_temporaryFilename.c_str());
+    }
+}
+
+bool FrameAnalysisWriter::open(const char* filename, FrameAnalysisFormat format, const FrameAnalysisFileHeader& header, const FrameAnalysisFileGrid* grids)
+{
+    m_format = format;
+    m_header = header;
+    m_filename = filename;
+    m_temporaryFilename = m_filename + ".tmp";
+    m_fileDescriptor = ::open(m_temporaryFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (m_fileDescriptor == -1) {
+        logging(LogLevel::Error, "Error: Failed to open output file %s: %s", m_temporaryFilename.c_str(), strerror(errno));
+        return false;
+    }
+
+    m_buffer.reserve(FrameAnalysisBufferSize + 1024);
+    return writeResumeKey() && prepareHeader(grids);
+}
+
+bool FrameAnalysisWriter::openResuming(const char* filename, FrameAnalysisFormat format, const FrameAnalysisFileHeader& header, const FrameAnalysisFileGrid* grids, ResumePoint& resumePoint)
+{
+    m_flushesEveryRow = true;
+    resumePoint = ResumePoint();
+
+    // The rows of an interrupted run are in the temporary file, which it never renamed.
+    string temporaryFilename = string(filename) + ".tmp";
+    int fileDescriptor = ::open(temporaryFilename.c_str(), O_RDWR);
+    if (fileDescriptor == -1)
+        return open(filename, format, header, grids);
+
+    string contents;
+    char buffer[64 * 1024];
+    ssize_t result;
+    while ((result = read(fileDescriptor, buffer, sizeof(buffer))) > 0 || (result < 0 && errno == EINTR)) {
+        if (result > 0)
+            contents.append(buffer, result);
+    }
+    if (result < 0) {
+        logging(LogLevel::Error, "Error: Failed to read %s: %s", temporaryFilename.c_str(), strerror(errno));
+        close(fileDescriptor);
+        return false;
+    }
+
+    m_format = format;
+    m_header = header;
+    m_filename = filename;
+    m_temporaryFilename = temporaryFilename;
+    m_fileDescriptor = fileDescriptor;
+    m_buffer.reserve(FrameAnalysisBufferSize + 1024);
+    if (!prepareHeader(grids))
+        return false;
+
+    // If the earlier output can't be used, because it was written with different options, for instance with different
+    // grids or sampling, start over.
+    std::ifstream resumeKeyFile(m_temporaryFilename + ".key");
+    string resumeKey((std::istreambuf_iterator<char>(resumeKeyFile)), std::istreambuf_iterator<char>());
+    if (resumeKey != m_resumeKey || !resumeFrom(contents, resumePoint)) {
+        logging(LogLevel::Warning, "Warning: Can't resume from %s; starting over.", m_temporaryFilename.c_str());
+        resumePoint = ResumePoint();
+        if (ftruncate(m_fileDescriptor, 0) || lseek(m_fileDescriptor, 0, SEEK_SET)) {
+            logging(LogLevel::Error, "Error: Failed to truncate %s: %s", m_temporaryFilename.c_str(), strerror(errno));
+            return false;
+        }
+        return writeResumeKey();
+    }
+
+    // The buffered header has already been written, so only keep the rows that are complete, and append after them.
+    off_t resumeOffset = m_buffer.size();
+    m_buffer.clear();
+    if (ftruncate(m_fileDescriptor, resumeOffset) || lseek(m_fileDescriptor, resumeOffset, SEEK_SET) != resumeOffset) {
+        logging(LogLevel::Error, "Error: Failed to truncate %s: %s", m_temporaryFilename.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Finds the last complete row of an interrupted run's output. On success, m_buffer holds the output up to and including
+// that row, which is what the file is truncated to; nothing needs to be written for it.
+bool FrameAnalysisWriter::resumeFrom(const string& contents, ResumePoint& resumePoint)
+{
+    if (m_format == FrameAnalysisFormat::Binary) {
+        // The record count in the header is only written on commit, so count the complete records instead.
+        size_t headerSize = m_buffer.size();
+        if (contents.size() < headerSize || contents.compare(sizeof(FrameAnalysisFileHeader), headerSize - sizeof(FrameAnalysisFileHeader), m_buffer, sizeof(FrameAnalysisFileHeader), string::npos))
+            return false;
+        auto& header = *reinterpret_cast<const FrameAnalysisFileHeader*>(contents.data());
+        if (memcmp(&header, &m_header, offsetof(FrameAnalysisFileHeader, recordCount)))
+            return false;
+
+        uint64_t recordCount = (contents.size() - headerSize) / m_header.recordSize;
+        if (recordCount) {
+            size_t lastRecordOffset = headerSize + (recordCount - 1) * m_header.recordSize;
+            memcpy(&resumePoint.timestamp, &contents[lastRecordOffset], sizeof(resumePoint.timestamp));
+            resumePoint.lastMedians.resize(m_header.cellCount);
+            memcpy(resumePoint.lastMedians.data(), &contents[lastRecordOffset + sizeof(int64_t)], m_header.cellCount * sizeof(float));
+        }
+        resumePoint.rowCount = recordCount;
+        m_header.recordCount = recordCount;
+        m_buffer.assign(contents, 0, headerSize + recordCount * m_header.recordSize);
+        return true;
+    }
+
+    // Each CSV row has a timestamp in seconds, followed by one median for each cell, and the duplicate flag if marking.
+    size_t endOfRows = contents.rfind('\n');
+    if (endOfRows == string::npos) {
+        m_buffer.clear();
+        return true;
+    }
+
+    size_t lastRowStart = contents.rfind('\n', endOfRows - 1);
+    lastRowStart = lastRowStart == string::npos || !endOfRows ? 0 : lastRowStart + 1;
+    string lastRow = contents.substr(lastRowStart, endOfRows - lastRowStart);
+    if (static_cast<size_t>(std::count(lastRow.begin(), lastRow.end(), ',')) != m_header.cellCount + m_marksDuplicates)
+        return false;
+
+    // Timestamps are written with %g's six significant digits, so the last keyframe was within half a unit in the last
+    // place of the written value; resume after the latest timestamp it could have been.
+    char* end;
+    double seconds = strtod(lastRow.c_str(), &end);
+    if (end == lastRow.c_str() || *end != ',')
+        return false;
+    double tolerance = seconds ? 5e-6 * std::abs(seconds) : 0;
+    resumePoint.timestamp = static_cast<int64_t>(std::floor((seconds + tolerance) / av_q2d({ m_header.timeBaseNumerator, m_header.timeBaseDenominator })));
+    resumePoint.rowCount = std::count(contents.begin(), contents.begin() + endOfRows + 1, '\n');
+
+    // Skip back over the rows marked as duplicates to the one they were compared with. The first row is never one.
+    size_t rowStart = lastRowStart;
+    size_t rowEnd = endOfRows;
+    while (m_marksDuplicates && rowEnd - rowStart >= 2 && !contents.compare(rowEnd - 2, 2, ",1")) {
+        if (!rowStart)
+            return false;
+        rowEnd = rowStart - 1;
+        size_t previousRowEnd = rowEnd ? contents.rfind('\n', rowEnd - 1) : string::npos;
+        rowStart = previousRowEnd == string::npos ? 0 : previousRowEnd + 1;
+    }
+
+    // The medians were written with %g's six significant digits, if they aren't whole or half values.
+    const char* field = &contents[rowStart];
+    strtod(field, &end);
+    for (unsigned i = 0; i < m_header.cellCount; ++i) {
+        if (*end != ',')
+            return false;
+        field = end + 1;
+        resumePoint.lastMedians.push_back(strtof(field, &end));
+        if (end == field)
+            return false;
+    }
+
+    m_buffer.assign(contents, 0, endOfRows + 1);
+    return true;
+}
+
+bool FrameAnalysisWriter::prepareHeader(const FrameAnalysisFileGrid* grids)
+{
+    m_header.cellCount = 0;
+    for (unsigned i = 0; i < m_header.gridCount; ++i)
+        m_header.cellCount += grids[i].columns * grids[i].rows;
+    if (m_format == FrameAnalysisFormat::CSV)
+        return true;
+
+    memcpy(m_header.magic, FrameAnalysisFileMagic, sizeof(m_header.magic));
+    m_header.version = FrameAnalysisFileVersion;
+    m_header.headerSize = frameAnalysisFileHeaderSize(m_header.gridCount);
+    m_header.recordSize = frameAnalysisFileRecordSize(m_header.cellCount);
+    m_header.recordCount = 0;
+
+    // The record count is filled in by commit(), once it's known.
+    m_buffer.append(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+    m_buffer.append(reinterpret_cast<const char*>(grids), m_header.gridCount * sizeof(FrameAnalysisFileGrid));
+    m_buffer.resize(m_header.headerSize);
+    return true;
+}
+
+bool FrameAnalysisWriter::flush()
+{
+    size_t written = 0;
+    while (written < m_buffer.size()) {
+        ssize_t result = write(m_fileDescriptor, &m_buffer[written], m_buffer.size() - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0) {
+            logging(LogLevel::Error, "Error: Failed to write output file: %s", strerror(errno));
+            return false;
+        }
+        written += result;
+    }
+
+    m_buffer.clear();
+    return true;
+}
+
+// Formats values the same way as the default stream formatting, i.e. printf's %g. Medians are always whole or half
+// values, so those are formatted directly.
+void FrameAnalysisWriter::appendValue(float value)
+{
+    float doubledValue = value * 2;
+    if (value >= 0 && value < 1000000 && doubledValue == static_cast<unsigned>(doubledValue)) {
+        char digits[8];
+        unsigned wholeValue = static_cast<unsigned>(value);
+        unsigned length = 0;
+        do {
+            digits[length++] = '0' + wholeValue % 10;
+            wholeValue /= 10;
+        } while (wholeValue);
+        while (length)
+            m_buffer.push_back(digits[--length]);
+        if (static_cast<unsigned>(doubledValue) & 1)
+            m_buffer.append(".5");
+        return;
+    }
+
+    char formattedValue[32];
+    int length = snprintf(formattedValue, sizeof(formattedValue), "%g", value);
+    m_buffer.append(formattedValue, length);
+}
+
+void FrameAnalysisWriter::appendRecord(int64_t timestamp, const float* values, unsigned count)
+{
+    size_t recordStart = m_buffer.size();
+    m_buffer.append(reinterpret_cast<const char*>(&timestamp), sizeof(timestamp));
+    m_buffer.append(reinterpret_cast<const char*>(values), count * sizeof(float));
+    m_buffer.resize(recordStart + m_header.recordSize);
+    ++m_header.recordCount;
+}
+
+bool FrameAnalysisWriter::writeRow(int64_t timestamp, const float* values, unsigned count, bool isDuplicate)
+{
+    StageTimer timer(Stage::Write);
+    if (m_format == FrameAnalysisFormat::Binary)
+        appendRecord(timestamp, values, count);
+    else {
+        appendValue(timestamp * av_q2d({ m_header.timeBaseNumerator, m_header.timeBaseDenominator }));
+        for (unsigned i = 0; i < count; ++i) {
+            m_buffer.push_back(',');
+            appendValue(values[i]);
+        }
+        if (m_marksDuplicates)
+            m_buffer.append(isDuplicate ? ",1" : ",0");
+        m_buffer.push_back('\n');
+    }
+
+    if (m_flushesEveryRow || m_buffer.size() >= FrameAnalysisBufferSize)
+        return flush();
+    return true;
+}
+
+bool FrameAnalysisWriter::writeFormattedRows(const string& rows)
+{
+    m_buffer.append(rows);
+    return flush();
+}
+
+bool FrameAnalysisWriter::commit()
+{
+    if (!flush())
+        return false;
+
+    if (m_format == FrameAnalysisFormat::Binary && pwrite(m_fileDescriptor, &m_header, sizeof(m_header), 0) != sizeof(m_header)) {
+        logging(LogLevel::Error, "Error: Failed to write output file header: %s", strerror(errno));
+        return false;
+    }
+
+    if (fsync(m_fileDescriptor) || close(m_fileDescriptor)) {
+        logging(LogLevel::Error, "Error: Failed to write output file: %s", strerror(errno));
+        return false;
+    }
+    m_fileDescriptor = -1;
+
+    if (rename(m_temporaryFilename.c_str(), m_filename.c_str())) {
+        logging(LogLevel::Error, "Error: Failed to rename %s to %s: %s", m_temporaryFilename.c_str(), m_filename.c_str(), strerror(errno));
+        unlink(m_temporaryFilename.c_str());
+        return false;
+    }
+    if (m_flushesEveryRow)
+        unlink((m_temporaryFilename + ".key").c_str());
+
+    return true;
+}
+
+// A resumable output file's key is written next to it, so that a later run can tell whether it was written with the
+// same options.
+bool FrameAnalysisWriter::writeResumeKey()
+{
+    return !m_flushesEveryRow || writeFile(m_temporaryFilename + ".key", m_resumeKey);
+}
+
+bool mergeFrameAnalysisFiles(const char* outputFile, const vector<string>& shardFiles)
+{
+    FrameAnalysisWriter writer;
+
+    // A shard that can be opened as a binary file is one; otherwise, the shards are taken to be CSV.
+    FrameAnalysisFile firstShard;
+    if (!shardFiles.empty() && firstShard.open(shardFiles[0].c_str())) {
+        auto& header = firstShard.header();
+        if (!writer.open(outputFile, FrameAnalysisFormat::Binary, header, firstShard.grids()))
+            return false;
+
+        int64_t lastTimestamp = INT64_MIN;
+        for (auto& shardFile : shardFiles) {
+            FrameAnalysisFile shard;
+            if (!shard.open(shardFile.c_str())) {
+                logging(LogLevel::Error, "Error: %s isn't a complete binary frame analysis file.", shardFile.c_str());
+                return false;
+            }
+            if (memcmp(&shard.header(), &header, offsetof(FrameAnalysisFileHeader, recordCount))
+                || memcmp(shard.grids(), firstShard.grids(), header.gridCount * sizeof(FrameAnalysisFileGrid))) {
+                logging(LogLevel::Error, "Error: %s doesn't describe the same stream and grids as %s.", shardFile.c_str(), shardFiles[0].c_str());
+                return false;
+            }
+
+            for (uint64_t i = 0; i < shard.recordCount(); ++i) {
+                if (shard.timestamp(i) < lastTimestamp) {
+                    logging(LogLevel::Error, "Error: %s starts before the end of the shard before it; shards must be given in order.", shardFile.c_str());
+                    return false;
+                }
+                lastTimestamp = shard.timestamp(i);
+                if (!writer.writeRow(lastTimestamp, shard.medians(i), header.cellCount))
+                    return false;
+            }
+        }
+        return writer.commit();
+    }
+
+    // CSV files have no header, so they're concatenated, after checking that they have the same columns and are in
+    // order.
+    if (!writer.open(outputFile, FrameAnalysisFormat::CSV, { }, nullptr))
+        return false;
+
+    double lastSeconds = -INFINITY;
+    size_t expectedColumnCount = 0;
+    for (auto& shardFile : shardFiles) {
+        string contents;
+        if (!readFile(shardFile, contents))
+            return false;
+        if (contents.empty())
+            continue;
+
+        size_t lastRowStart = contents.rfind('\n', contents.size() - 2);
+        lastRowStart = lastRowStart == string::npos ? 0 : lastRowStart + 1;
+        double firstSeconds;
+        double lastRowSeconds;
+        size_t columnCount;
+        size_t lastRowColumnCount;
+        if (contents.back() != '\n' || !parseCSVRow(contents, 0, firstSeconds, columnCount) || !parseCSVRow(contents, lastRowStart, lastRowSeconds, lastRowColumnCount)
+            || lastRowColumnCount != columnCount) {
+            logging(LogLevel::Error, "Error: %s isn't a complete frame analysis file.", shardFile.c_str());
+            return false;
+        }
+        if (expectedColumnCount && columnCount != expectedColumnCount) {
+            logging(LogLevel::Error, "Error: %s doesn't have the same columns as the shards before it.", shardFile.c_str());
+            return false;
+        }
+        if (firstSeconds < lastSeconds) {
+            logging(LogLevel::Error, "Error: %s starts before the end of the shard before it; shards must be given in order.", shardFile.c_str());
+            return false;
+        }
+
+        expectedColumnCount = columnCount;
+        lastSeconds = lastRowSeconds;
+        if (!writer.writeFormattedRows(contents))
+            return false;
+    }
+    return writer.commit();
+}
+
+// Reads the timestamp and counts the columns of the CSV row that starts at rowStart.
+static bool parseCSVRow(const string& contents, size_t rowStart, double& seconds, size_t& columnCount)
+{
+    size_t rowEnd = contents.find('\n', rowStart);
+    if (rowEnd == string::npos)
+        return false;
+
+    char* end;
+    seconds = strtod(&contents[rowStart], &end);
+    if (end == &contents[rowStart] || *end != ',')
+        return false;
+
+    columnCount = 1 + std::count(contents.begin() + rowStart, contents.begin() + rowEnd, ',');
+    return true;
+}
+
+// Storage for per-cell data along one row of the grid. When the number of columns is known at compile time, it lives on
+// the stack; otherwise, it's in a buffer that each thread reuses, so that it's only allocated once. Either way, its
+// items start out uninitialized.
+template<typename T, unsigned Size>
+class GridRowStorage {
+public:
+    explicit GridRowStorage(size_t) { }
+    T* data() { return m_items.data(); }
+    T& operator[](size_t i) { return m_items[i]; }
+
+private:
+    array<T, Size> m_items;
+};
+
+template<typename T>
+class GridRowStorage<T, 0> {
+public:
+    explicit GridRowStorage(size_t size)
+        : m_items(buffer())
+    {
+        m_items.resize(size);
+    }
+    T* data() { return m_items.data(); }
+    T& operator[](size_t i) { return m_items[i]; }
+
+private:
+    static vector<T>& buffer()
+    {
+        static thread_local vector<T> items;
+        return items;
+    }
+
+    vector<T>& m_items;
+};
+
+// Computes the cell medians of a GRAY8 frame, counting each pixel as the value lumaValues maps it to, if it isn't null.
+// If Columns and Rows are nonzero, they must match grid, and the size of the grid is fixed at compile time; otherwise,
+// it's taken from grid at runtime.
+template<unsigned Columns, unsigned Rows>
+static bool analyzeGrayscaleFrameWithGrid(const AVFrame* frame, const Grid& grid, const float* lumaValues, float* cellMedians)
+{
+    static const RowHistogramKernel accumulateRow = selectRowHistogramKernel<Columns>();
+    const unsigned columns = Columns ? Columns : grid.columns;
+    const unsigned rows = Rows ? Rows : grid.rows;
+
+    int lineSize = frame->linesize[0];
+    auto data = frame->data[0];
+
+    // Every band of cells shares the same column boundaries, so compute them once.
+    GridRowStorage<unsigned, Columns ? Columns + 1 : 0> cellStarts(columns + 1);
+    int remainingWidth = frame->width;
+    for (unsigned x = 0; x < columns; ++x) {
+        cellStarts[x] = frame->width - remainingWidth;
+        remainingWidth -= remainingWidth / (columns - x);
+    }
+    cellStarts[columns] = frame->width;
+
+    GridRowStorage<CellHistogram, Columns> histograms(columns);
+    int remainingHeight = frame->height;
+    for (unsigned y = 0; y < rows; ++y) {
+        unsigned yOffset = frame->height - remainingHeight;
+        unsigned yPixels = remainingHeight / (rows - y);
+        remainingHeight -= yPixels;
+
+        // Horizontal lines may contain additional padding bytes. lineSize includes this padding, so use it to determine
+        // the start of each row. See <https://ffmpeg.org/doxygen/trunk/structAVFrame.html#aa52bfc6605f6a3059a0c3226cc0f6567>.
+        memset(histograms.data(), 0, columns * sizeof(CellHistogram));
+        for (unsigned row = 0; row < yPixels; ++row)
+            accumulateRow(&data[(yOffset + row) * lineSize], cellStarts.data(), columns, histograms.data());
+
+        for (unsigned x = 0; x < columns; ++x) {
+            unsigned xPixels = cellStarts[x + 1] - cellStarts[x];
+            cellMedians[y * columns + x] = cellHistogramMedian(histograms[x], xPixels * yPixels, lumaValues);
+        }
+    }
+
+    return true;
+}
+
+// Common grid sizes use analysis code specialized for their size; any other size uses the generic version.
+static bool analyzeGrayscaleFrame(const AVFrame* frame, const Grid& grid, const float* lumaValues, float* cellMedians)
+{
+    if (grid.columns == grid.rows) {
+        switch (grid.columns) {
+        case 1:
+            return analyzeGrayscaleFrameWithGrid<1, 1>(frame, grid, lumaValues, cellMedians);
+        case 2:
+            return analyzeGrayscaleFrameWithGrid<2, 2>(frame, grid, lumaValues, cellMedians);
+        case 3:
+            return analyzeGrayscaleFrameWithGrid<3, 3>(frame, grid, lumaValues, cellMedians);
+        case 4:
+            return analyzeGrayscaleFrameWithGrid<4, 4>(frame, grid, lumaValues, cellMedians);
+        case 8:
+            return analyzeGrayscaleFrameWithGrid<8, 8>(frame, grid, lumaValues, cellMedians);
+        }
+    }
+
+    return analyzeGrayscaleFrameWithGrid<0, 0>(frame, grid, lumaValues, cellMedians);
+}
+
+// Sets boundaries to those of the cells when length pixels are divided into count cells: cell i spans
+// [boundaries[i], boundaries[i + 1]). This is the same division used by analyzeGrayscaleFrameWithGrid.
+static void cellBoundaries(unsigned length, unsigned count, vector<unsigned>& boundaries)
+{
+    boundaries.resize(count + 1);
+    unsigned remainingLength = length;
+    for (unsigned i = 0; i < count; ++i) {
+        boundaries[i] = length - remainingLength;
+        remainingLength -= remainingLength / (count - i);
+    }
+    boundaries[count] = length;
+}
+
+// For each piece between consecutive boundaries in pieceBoundaries, sets cellIndices to the index of the cell between
+// cellBoundaries that contains it. Every boundary in cellBoundaries must also be in pieceBoundaries.
+static void cellIndicesOfPieces(const vector<unsigned>& pieceBoundaries, const vector<unsigned>& cellBoundaries, vector<unsigned>& cellIndices)
+{
+    cellIndices.resize(pieceBoundaries.size() - 1);
+    unsigned cell = 0;
+    for (unsigned piece = 0; piece < cellIndices.size(); ++piece) {
+        while (cellBoundaries[cell + 1] <= pieceBoundaries[piece])
+            ++cell;
+        cellIndices[piece] = cell;
+    }
+}
+
+// Computes the cell medians of several grids in a single pass over a GRAY8 frame. The frame is divided into pieces
+// along the cell boundaries of every grid, so that each cell of each grid is made up of whole pieces. The histogram of
+// each piece is computed once, then added to the histogram of the cell containing it in each grid. The medians of each
+// grid are stored one after another in cellMedians. Pixels are counted as the values lumaValues maps them to, if it
+// isn't null.
+static bool analyzeGrayscaleFrameWithGrids(const AVFrame* frame, const vector<Grid>& grids, const float* lumaValues, float* cellMedians)
+{
+    static const RowHistogramKernel accumulateRow = selectRowHistogramKernel<0>();
+
+    // The layout and histograms are kept in buffers that each thread reuses, so that they're only allocated for the
+    // first keyframe it analyzes.
+    struct GridLayout {
+        vector<unsigned> columns;
+        vector<unsigned> rows;
+        vector<unsigned> columnOfPiece;
+        vector<unsigned> rowOfPiece;
+        size_t firstCell;
+    };
+    static thread_local vector<GridLayout> layouts;
+    static thread_local vector<unsigned> pieceColumns;
+    static thread_local vector<unsigned> pieceRows;
+    layouts.resize(grids.size());
+    pieceColumns.clear();
+    pieceRows.clear();
+    size_t totalCellCount = 0;
+    for (size_t gridIndex = 0; gridIndex < grids.size(); ++gridIndex) {
+        auto& grid = grids[gridIndex];
+        auto& layout = layouts[gridIndex];
+        cellBoundaries(frame->width, grid.columns, layout.columns);
+        cellBoundaries(frame->height, grid.rows, layout.rows);
+        layout.firstCell = totalCellCount;
+        totalCellCount += grid.cellCount();
+        pieceColumns.insert(pieceColumns.end(), layout.columns.begin(), layout.columns.end());
+        pieceRows.insert(pieceRows.end(), layout.rows.begin(), layout.rows.end());
+    }
+    std::sort(pieceColumns.begin(), pieceColumns.end());
+    pieceColumns.erase(std::unique(pieceColumns.begin(), pieceColumns.end()), pieceColumns.end());
+    std::sort(pieceRows.begin(), pieceRows.end());
+    pieceRows.erase(std::unique(pieceRows.begin(), pieceRows.end()), pieceRows.end());
+
+    // Map each piece to the cell containing it in every grid.
+    for (auto& layout : layouts) {
+        cellIndicesOfPieces(pieceColumns, layout.columns, layout.columnOfPiece);
+        cellIndicesOfPieces(pieceRows, layout.rows, layout.rowOfPiece);
+    }
+
+    using Histogram = array<uint32_t, 256>;
+    static thread_local vector<Histogram> cellHistograms;
+    cellHistograms.resize(totalCellCount);
+    memset(cellHistograms.data(), 0, cellHistograms.size() * sizeof(Histogram));
+
+    int lineSize = frame->linesize[0];
+    auto data = frame->data[0];
+    unsigned pieceColumnCount = pieceColumns.size() - 1;
+    static thread_local vector<CellHistogram> pieceHistograms;
+    pieceHistograms.resize(pieceColumnCount);
+    for (unsigned pieceRow = 0; pieceRow + 1 < pieceRows.size(); ++pieceRow) {
+        unsigned yOffset = pieceRows[pieceRow];
+        unsigned yPixels = pieceRows[pieceRow + 1] - yOffset;
+
+        memset(pieceHistograms.data(), 0, pieceHistograms.size() * sizeof(CellHistogram));
+        for (unsigned row = 0; row < yPixels; ++row)
+            accumulateRow(&data[(yOffset + row) * lineSize], pieceColumns.data(), pieceColumnCount, pieceHistograms.data());
+
+        for (unsigned pieceColumn = 0; pieceColumn < pieceColumnCount; ++pieceColumn) {
+            Histogram pieceHistogram;
+            for (unsigned value = 0; value < 256; ++value) {
+                pieceHistogram[value] = 0;
+                for (unsigned i = 0; i < SubHistogramCount; ++i)
+                    pieceHistogram[value] += pieceHistograms[pieceColumn].counts[i][value];
+            }
+
+            for (size_t gridIndex = 0; gridIndex < grids.size(); ++gridIndex) {
+                auto& layout = layouts[gridIndex];
+                size_t cell = layout.firstCell + layout.rowOfPiece[pieceRow] * grids[gridIndex].columns + layout.columnOfPiece[pieceColumn];
+                for (unsigned value = 0; value < 256; ++value)
+                    cellHistograms[cell][value] += pieceHistogram[value];
+            }
+        }
+    }
+
+    for (size_t gridIndex = 0; gridIndex < grids.size(); ++gridIndex) {
+        auto& grid = grids[gridIndex];
+        auto& layout = layouts[gridIndex];
+        for (unsigned y = 0; y < grid.rows; ++y) {
+            for (unsigned x = 0; x < grid.columns; ++x) {
+                size_t cell = layout.firstCell + y * grid.columns + x;
+                unsigned pixelCount = (layout.columns[x + 1] - layout.columns[x]) * (layout.rows[y + 1] - layout.rows[y]);
+                cellMedians[cell] = histogramMedian(cellHistograms[cell].data(), pixelCount, lumaValues);
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool readFile(const string& filename, string& contents)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        logging(LogLevel::Error, "Error: Failed to open %s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (file.bad()) {
+        logging(LogLevel::Error, "Error: Failed to read %s.", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Writes the whole buffer to a new file with a single write, unless the write is interrupted or partial.
+static bool writeFile(const string& filename, const string& contents)
+{
+    int fileDescriptor = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fileDescriptor == -1) {
+        logging(LogLevel::Error, "Error: Failed to open %s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!writeContents(fileDescriptor, contents)) {
+        logging(LogLevel::Error, "Error: Failed to write %s: %s", filename.c_str(), strerror(errno));
+        close(fileDescriptor);
+        return false;
+    }
+    if (close(fileDescriptor)) {
+        logging(LogLevel::Error, "Error: Failed to write %s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Writes all of contents to the file, retrying interrupted and partial writes. On failure, errno is left set.
+static bool writeContents(int fileDescriptor, const string& contents)
+{
+    size_t written = 0;
+    while (written < contents.size()) {
+        ssize_t result = write(fileDescriptor, &contents[written], contents.size() - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            return false;
+        written += result;
+    }
+    return true;
+}
+
+ImageExporter::ImageExporter(ImageFormat format, unsigned maximumWidth, unsigned threadCount, size_t queueDepth)
+    : m_format(format)
+    , m_maximumWidth(maximumWidth)
+    , m_queue(queueDepth)
+{
+    for (unsigned i = 0; i < threadCount; ++i)
+        m_workers.emplace_back([this] { run(); });
+}
+
+ImageExporter::~ImageExporter()
+{
+    finish();
+}
+
+bool ImageExporter::exportFrame(const AVFrame* frame, string filename)
+{
+    static const char* Extensions[] = { ".pgm", ".png", ".jpg" };
+
+    // Take a new reference to the frame's buffers, so that the analysis can carry on with the frame while it's written.
+    AVFramePtr reference(av_frame_clone(frame));
+    if (!reference) {
+        logging(LogLevel::Error, "Error: Failed to reference keyframe image.");
+        return false;
+    }
+
+    return m_queue.push({ std::move(reference), filename + Extensions[static_cast<size_t>(m_format)] });
+}
+
+bool ImageExporter::finish()
+{
+    m_queue.close();
+    for (auto& worker : m_workers)
+        worker.join();
+    m_workers.clear();
+    return !m_failureCount;
+}
+
+void ImageExporter::run()
+{
+    GrayscaleConverter thumbnailConverter;
+    AVCodecContextPtr encoder;
+    string image;
+    Job job;
+    while (m_queue.pop(job)) {
+        const AVFrame* frame = job.frame.get();
+        AVFramePtr thumbnail;
+        if (m_maximumWidth && static_cast<unsigned>(frame->width) > m_maximumWidth) {
+            int height = std::max(1, static_cast<int>(static_cast<int64_t>(frame->height) * m_maximumWidth / frame->width));
+            // Only the luma plane is scaled, as it's already full range, and converting a YUV frame would expand it.
+            thumbnail = thumbnailConverter.scaleLuma(frame, m_maximumWidth, height, SWS_AREA);
+            if (!thumbnail) {
+                ++m_failureCount;
+                continue;
+            }
+            frame = thumbnail.get();
+        }
+
+        image.clear();
+        if (!encode(frame, encoder, image) || !writeFile(job.filename, image))
+            ++m_failureCount;
+
+        if (thumbnail)
+            thumbnailConverter.recycleFrame(std::move(thumbnail));
+        job.frame.reset();
+    }
+}
+
+// Encodes the frame's luma plane into image. The encoder is kept between images, and only recreated if the image size
+// changes.
+bool ImageExporter::encode(const AVFrame* frame, AVCodecContextPtr& encoder, string& image) const
+{
+    int width = frame->width;
+    int height = frame->height;
+
+    if (m_format == ImageFormat::PGM) {
+        // For format description, see <https://en.wikipedia.org/wiki/Netpbm_format#PGM_example>. We cannot write the
+        // entire contents of the plane, because each horizontal line may contain additional padding bytes for
+        // performance reasons, so copy each row without its padding.
+        image = "P5\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        image.reserve(image.size() + static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; ++y)
+            image.append(reinterpret_cast<const char*>(&frame->data[0][y * frame->linesize[0]]), width);
+        return true;
+    }
+
+    // The PNG encoder takes GRAY8 frames, but the MJPEG encoder only takes YUV, so give it neutral chroma planes.
+    AVPixelFormat pixelFormat = m_format == ImageFormat::PNG ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUVJ420P;
+    if (!encoder || encoder->width != width || encoder->height != height) {
+        AVCodec* codec = avcodec_find_encoder(m_format == ImageFormat::PNG ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG);
+        if (!codec) {
+            logging(LogLevel::Error, "Error: Failed to find an image encoder.");
+            return false;
+        }
+
+        encoder.reset(avcodec_alloc_context3(codec));
+        encoder->width = width;
+        encoder->height = height;
+        encoder->pix_fmt = pixelFormat;
+        encoder->time_base = { 1, 25 };
+        encoder->flags |= AV_CODEC_FLAG_QSCALE;
+        encoder->global_quality = FF_QP2LAMBDA * 3;
+        int result = avcodec_open2(encoder.get(), codec, nullptr);
+        if (result < 0) {
+            logging(LogLevel::Error, "Error: Failed to open image encoder: %s", AVError(result));
+            encoder.reset();
+            return false;
+        }
+    }
+
+    // Point the encoder's input at the luma plane, rather than copying it.
+    AVFramePtr input(av_frame_alloc());
+    input->format = pixelFormat;
+    input->width = width;
+    input->height = height;
+    input->quality = encoder->global_quality;
+    input->data[0] = frame->data[0];
+    input->linesize[0] = frame->linesize[0];
+    vector<uint8_t> neutralChroma;
+    if (pixelFormat == AV_PIX_FMT_YUVJ420P) {
+        int chromaWidth = (width + 1) / 2;
+        neutralChroma.assign(static_cast<size_t>(chromaWidth) * ((height + 1) / 2), 128);
+        for (int plane = 1; plane < 3; ++plane) {
+            input->data[plane] = neutralChroma.data();
+            input->linesize[plane] = chromaWidth;
+        }
+    }
+
+    int result = avcodec_send_frame(encoder.get(), input.get());
+    AVPacketPtr packet(av_packet_alloc());
+    if (result >= 0)
+        result = avcodec_receive_packet(encoder.get(), packet.get());
+    if (result < 0) {
+        logging(LogLevel::Error, "Error: Failed to encode keyframe image: %s", AVError(result));
+        return false;
+    }
+
+    image.assign(reinterpret_cast<const char*>(packet->data), packet->size);
+    return true;
+}
+
+// Creates a frame of the given format and size, with pseudorandom luma on top of a gradient, so that every cell has a
+// different, realistic spread of values, and neutral chroma.
+static AVFramePtr createBenchmarkFrame(AVPixelFormat format, int width, int height)
+{
+    AVFramePtr frame(av_frame_alloc());
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame.get(), 0) < 0)
+        return nullptr;
+
+    uint32_t state = 2463534242u;
+    for (int plane = 0; plane < AV_NUM_DATA_POINTERS && frame->data[plane]; ++plane) {
+        int planeHeight = plane && format == AV_PIX_FMT_YUV420P ? (height + 1) / 2 : height;
+        for (int y = 0; y < planeHeight; ++y) {
+            uint8_t* row = frame->data[plane] + y * frame->linesize[plane];
+            for (int x = 0; x < frame->linesize[plane]; ++x) {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                row[x] = plane && format == AV_PIX_FMT_YUV420P ? 128 : (x + y) / 16 + state % 64;
+            }
+        }
+    }
+
+    return frame;
+}
+
+// Runs the operation until at least BenchmarkDuration has passed, and returns the average time it took, in
+// milliseconds, or a negative value if it failed.
+template<typename Operation>
+static double benchmark(Operation operation)
+{
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+    static const auto BenchmarkDuration = std::chrono::milliseconds(500);
+
+    // Warm up the caches and any lazily created state, like the histogram kernel selection.
+    if (!operation())
+        return -1;
+
+    unsigned iterationCount = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = start - start;
+    while (elapsed < BenchmarkDuration) {
+        if (!operation())
+            return -1;
+        ++iterationCount;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return Milliseconds(elapsed).count() / iterationCount;
+}
+
+// Measures the median kernels, the conversion to GRAY8, and the whole analysis of a keyframe, over synthetic frames,
+// and writes the results to filename as JSON, one result per line, so that runs from different commits can be compared.
+// The end-to-end speed of decoding real clips is measured by the Makefile's bench target, using --stats-json.
+bool runBenchmarks(const char* filename)
+{
+    static const char* KernelNames[] = { "scalar", "sse4.1", "avx2", "neon" };
+    struct Resolution {
+        const char* name;
+        int width;
+        int height;
+    };
+    static const Resolution Resolutions[] = { { "480p", 854, 480 }, { "1080p", 1920, 1080 }, { "2160p", 3840, 2160 } };
+    static const Grid Grids[] = { { 1, 1 }, { 3, 3 }, { 8, 8 }, { 16, 9 } };
+
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        logging(LogLevel::Error, "Error: Failed to open benchmark results file %s: %s", filename, strerror(errno));
+        return false;
+    }
+
+    const char* kernelName = KernelNames[static_cast<size_t>(histogramKernelType())];
+    bool succeeded = true;
+    auto report = [&](const char* benchmarkName, const Resolution& resolution, const char* detail, double milliseconds) {
+        if (milliseconds < 0) {
+            logging(LogLevel::Error, "Error: Benchmark %s failed at %s.", benchmarkName, resolution.name);
+            succeeded = false;
+            return;
+        }
+        double megapixelsPerSecond = resolution.width * resolution.height / (milliseconds * 1000);
+        logging("%-24s %-6s %-8s %9.3f ms %9.1f MP/s", benchmarkName, resolution.name, detail, milliseconds, megapixelsPerSecond);
+        fprintf(file, "{ \"benchmark\": \"%s\", \"resolution\": \"%s\", \"width\": %d, \"height\": %d, \"detail\": \"%s\", "
+            "\"kernel\": \"%s\", \"milliseconds\": %.4f, \"megapixels_per_second\": %.2f }\n",
+            benchmarkName, resolution.name, resolution.width, resolution.height, detail, kernelName, milliseconds, megapixelsPerSecond);
+    };
+
+    for (auto& resolution : Resolutions) {
+        AVFramePtr yuvFrame = createBenchmarkFrame(AV_PIX_FMT_YUV420P, resolution.width, resolution.height);
+        AVFramePtr rgbFrame = createBenchmarkFrame(AV_PIX_FMT_RGB24, resolution.width, resolution.height);
+        if (!yuvFrame || !rgbFrame) {
+            logging(LogLevel::Error, "Error: Failed to allocate benchmark frames.");
+            fclose(file);
+            return false;
+        }
+
+        // The direct luma path analyzes the decoder's Y plane in place, so its cost is just that of the medians.
+        CellMedians cellMedians;
+        for (auto& grid : Grids) {
+            char gridName[16];
+            snprintf(gridName, sizeof(gridName), "%ux%u", grid.columns, grid.rows);
+            cellMedians.resize(grid.cellCount());
+            report("medians", resolution, gridName, benchmark([&] {
+                return analyzeGrayscaleFrame(yuvFrame.get(), grid, nullptr, cellMedians.data());
+            }));
+        }
+
+        vector<Grid> grids { { 1, 1 }, { 3, 3 }, { 8, 8 } };
+        cellMedians.resize(1 + 9 + 64);
+        report("medians-multiple-grids", resolution, "1+3+8", benchmark([&] {
+            return analyzeGrayscaleFrameWithGrids(yuvFrame.get(), grids, nullptr, cellMedians.data());
+        }));
+
+        GrayscaleConverter grayscaleConverter;
+        for (auto& frame : { yuvFrame.get(), rgbFrame.get() }) {
+            const char* formatName = av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format));
+            report("convert-sws-scale", resolution, formatName, benchmark([&] {
+                AVFramePtr frameGrayscale = grayscaleConverter.convert(frame);
+                if (!frameGrayscale)
+                    return false;
+                grayscaleConverter.recycleFrame(std::move(frameGrayscale));
+                return true;
+            }));
+        }
+
+        AnalyzerOptions options;
+        options.grids.push_back({ DefaultHorizontalCellCount, DefaultVerticalCellCount });
+        AnalysisState analysisState;
+        report("keyframe-direct-luma", resolution, "3x3", benchmark([&] {
+            return analyzeKeyframe(yuvFrame.get(), 0, options, analysisState, cellMedians);
+        }));
+        report("keyframe-converted", resolution, "3x3", benchmark([&] {
+            return analyzeKeyframe(rgbFrame.get(), 0, options, analysisState, cellMedians);
+        }));
+        options.sampleStride = 4;
+        report("keyframe-sample-stride", resolution, "4", benchmark([&] {
+            return analyzeKeyframe(yuvFrame.get(), 0, options, analysisState, cellMedians);
+        }));
+    }
+
+    if (fclose(file)) {
+        logging(LogLevel::Error, "Error: Failed to write benchmark results file %s: %s", filename, strerror(errno));
+        return false;
+    }
+    return succeeded;
+}
+
+// The self-test checks every fast path against a simple reference: the median of each cell, found by sorting its
+// samples. The frames it checks are synthetic, with flat fields, gradients, and noise, at sizes that do and don't
+// divide evenly into the grids, with and without padding at the end of each line.
+enum class TestPattern { Flat, Gradient, Noise };
+
+struct SelfTestResults {
+    unsigned checkCount { 0 };
+    unsigned failureCount { 0 };
+
+    // Records a check, logging it if it failed.
+    void check(bool passed, const char* path, const string& testCase, const char* detail = "");
+    void checkMedians(const char* path, const string& testCase, const CellMedians& medians, const CellMedians& expected, float tolerance = 0);
+};
+
+void SelfTestResults::check(bool passed, const char* path, const string& testCase, const char* detail)
+{
+    ++checkCount;
+    if (passed)
+        return;
+    ++failureCount;
+    logging(LogLevel::Error, "Error: Self-test of %s failed for %s%s%s.", path, testCase.c_str(), *detail ? ": " : "", detail);
+}
+
+void SelfTestResults::checkMedians(const char* path, const string& testCase, const CellMedians& medians, const CellMedians& expected, float tolerance)
+{
+    char detail[128] = "";
+    if (medians.size() != expected.size())
+        snprintf(detail, sizeof(detail), "%zu medians, expected %zu", medians.size(), expected.size());
+    for (size_t i = 0; !*detail && i < medians.size(); ++i) {
+        if (std::abs(medians[i] - expected[i]) > tolerance)
+            snprintf(detail, sizeof(detail), "cell %zu is %g, expected %g", i, medians[i], expected[i]);
+    }
+    check(!*detail, path, testCase, detail);
+}
+
+// Returns the 10-bit sample of the pattern at (x, y). Flat fields and gradients are the same for every seed but for an
+// offset; noise differs entirely. The 8-bit sample is the 10-bit one shifted down.
+static unsigned testPatternSample(TestPattern pattern, int width, int height, int x, int y, uint32_t& noiseState, unsigned seed)
+{
+    switch (pattern) {
+    case TestPattern::Flat:
+        return ((77 + seed) % 256) * 4 + 2;
+    case TestPattern::Gradient:
+        return (x * 768 / width + y * 256 / height + seed * 4) % 1024;
+    case TestPattern::Noise:
+        noiseState ^= noiseState << 13;
+        noiseState ^= noiseState >> 17;
+        noiseState ^= noiseState << 5;
+        return noiseState % 1024;
+    }
+    return 0;
+}
+
+// Creates a frame whose luma follows the pattern, with neutral chroma, and returns its luma samples, row by row, in
+// luma. Every line is padded by padding samples past the width, plus whatever av_frame_get_buffer() adds, and all of
+// it is set to the maximum value, so that a path that reads past the end of a line gets different medians. RGB frames
+// are gray, so their luma is the value of each component.
+static AVFramePtr createTestFrame(AVPixelFormat format, int width, int height, TestPattern pattern, int padding, unsigned seed, vector<uint16_t>& luma)
+{
+    AVFramePtr frame(av_frame_alloc());
+    frame->format = format;
+    frame->width = width + padding;
+    frame->height = height;
+    if (av_frame_get_buffer(frame.get(), 0) < 0)
+        return nullptr;
+    frame->width = width;
+
+    auto descriptor = av_pix_fmt_desc_get(format);
+    bool isHighBitDepth = descriptor->comp[0].depth > 8;
+    bool isRGB = descriptor->flags & AV_PIX_FMT_FLAG_RGB;
+    luma.resize(static_cast<size_t>(width) * height);
+    uint32_t noiseState = 2463534242u + seed;
+    for (int y = 0; y < height; ++y) {
+        uint8_t* row = frame->data[0] + y * frame->linesize[0];
+        if (isHighBitDepth) {
+            auto samples = reinterpret_cast<uint16_t*>(row);
+            std::fill_n(samples, frame->linesize[0] / 2, 1023);
+            for (int x = 0; x < width; ++x)
+                samples[x] = luma[y * width + x] = testPatternSample(pattern, width, height, x, y, noiseState, seed);
+        } else if (isRGB) {
+            memset(row, 255, frame->linesize[0]);
+            for (int x = 0; x < width; ++x)
+                memset(&row[x * 3], luma[y * width + x] = testPatternSample(pattern, width, height, x, y, noiseState, seed) >> 2, 3);
+        } else {
+            memset(row, 255, frame->linesize[0]);
+            for (int x = 0; x < width; ++x)
+                row[x] = luma[y * width + x] = testPatternSample(pattern, width, height, x, y, noiseState, seed) >> 2;
+        }
+    }
+
+    for (int plane = 1; plane < AV_NUM_DATA_POINTERS && frame->data[plane]; ++plane) {
+        int planeHeight = AV_CEIL_RSHIFT(height, descriptor->log2_chroma_h);
+        for (int y = 0; y < planeHeight; ++y) {
+            uint8_t* row = frame->data[plane] + y * frame->linesize[plane];
+            if (isHighBitDepth)
+                std::fill_n(reinterpret_cast<uint16_t*>(row), frame->linesize[plane] / 2, 512);
+            else
+                memset(row, 128, frame->linesize[plane]);
+        }
+    }
+
+    return frame;
+}
+
+// Computes the reference medians. The cells are bounded independently of cellBoundaries(), as the same cells are: the
+// remainder of each dimension after dividing it by the grid's is spread over its last cells, one sample each.
+static CellMedians referenceCellMedians(const vector<uint16_t>& luma, int width, int height, const Grid& grid)
+{
+    auto cellStart = [](unsigned length, unsigned count, unsigned cell) {
+        unsigned firstLongerCell = count - length % count;
+        return cell * (length / count) + (cell > firstLongerCell ? cell - firstLongerCell : 0);
+    };
+
+    CellMedians medians;
+    vector<uint16_t> samples;
+    for (unsigned row = 0; row < grid.rows; ++row) {
+        for (unsigned column = 0; column < grid.columns; ++column) {
+            samples.clear();
+            for (unsigned y = cellStart(height, grid.rows, row); y < cellStart(height, grid.rows, row + 1); ++y) {
+                for (unsigned x = cellStart(width, grid.columns, column); x < cellStart(width, grid.columns, column + 1); ++x)
+                    samples.push_back(luma[y * width + x]);
+            }
+            std::sort(samples.begin(), samples.end());
+            size_t middle = samples.size() / 2;
+            medians.push_back(samples.size() & 1 ? samples[middle] : (samples[middle - 1] + samples[middle]) / 2.0f);
+        }
+    }
+    return medians;
+}
+
+// Returns limited range 8-bit luma expanded to full range, as the medians of untagged YUV frames are reported.
+static vector<uint16_t> fullRangeLuma(const vector<uint16_t>& luma)
+{
+    vector<uint16_t> expandedLuma(luma.size());
+    std::transform(luma.begin(), luma.end(), expandedLuma.begin(), [](uint16_t sample) {
+        return std::min(std::max(static_cast<int>(std::lround((sample - 16) * 255 / 219.0)), 0), 255);
+    });
+    return expandedLuma;
+}
+
+static CellMedians referenceCellMedians(const vector<uint16_t>& luma, int width, int height, const vector<Grid>& grids)
+{
+    CellMedians medians;
+    for (auto& grid : grids) {
+        CellMedians gridMedians = referenceCellMedians(luma, width, height, grid);
+        medians.insert(medians.end(), gridMedians.begin(), gridMedians.end());
+    }
+    return medians;
+}
+
+struct NamedRowHistogramKernel {
+    const char* name;
+    RowHistogramKernel kernel;
+};
+
+// Every kernel the CPU can run, so that all of them are checked, not just the one histogramKernelType() picks.
+template<unsigned CellCount>
+static vector<NamedRowHistogramKernel> supportedRowHistogramKernels()
+{
+    vector<NamedRowHistogramKernel> kernels { { "scalar kernel", accumulateRowScalar<CellCount> } };
+#if HAVE_X86_HISTOGRAM_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        kernels.push_back({ "sse4.1 kernel", accumulateRowSSE41<CellCount> });
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({ "avx2 kernel", accumulateRowAVX2<CellCount> });
+#elif HAVE_NEON_HISTOGRAM_KERNELS
+    kernels.push_back({ "neon kernel", accumulateRowNEON<CellCount> });
+#endif
+    return kernels;
+}
+
+// Checks that each kernel counts every row of a GRAY8 or 8-bit luma frame into the grid's columns as the reference
+// kernel does.
+template<unsigned CellCount>
+static void checkRowHistogramKernels(SelfTestResults& results, const AVFrame* frame, const Grid& grid, const string& testCase)
+{
+    vector<unsigned> cellStarts;
+    cellBoundaries(frame->width, grid.columns, cellStarts);
+    vector<CellHistogram> histograms(grid.columns);
+    for (auto& kernel : supportedRowHistogramKernels<CellCount>()) {
+        memset(histograms.data(), 0, histograms.size() * sizeof(CellHistogram));
+        for (int y = 0; y < frame->height; ++y)
+            kernel.kernel(frame->data[0] + y * frame->linesize[0], cellStarts.data(), grid.columns, histograms.data());
+        results.check(verifyCellHistograms(frame->data[0], frame->linesize[0], 0, frame->height, cellStarts.data(), grid.columns, histograms.data()), kernel.name, testCase);
+    }
+}
+
+// Checks every path that analyzes whole frames, and, for flat fields, whose medians every path must get exactly, the
+// downscaled ones too.
+static void checkFramePaths(SelfTestResults& results, int width, int height, TestPattern pattern, int padding)
+{
+    static const char* PatternNames[] = { "flat", "gradient", "noise" };
+    static const Grid Grids[] = { { 1, 1 }, { 3, 3 }, { 8, 8 }, { 16, 9 }, { 7, 5 } };
+    char testCaseName[64];
+    snprintf(testCaseName, sizeof(testCaseName), "%dx%d %s%s", width, height, PatternNames[static_cast<int>(pattern)], padding ? " padded" : "");
+    string testCase = testCaseName;
+
+    vector<uint16_t> luma;
+    vector<uint16_t> highBitDepthLuma;
+    vector<uint16_t> rgbLuma;
+    vector<uint16_t> unused;
+    AVFramePtr yuvFrame = createTestFrame(AV_PIX_FMT_YUV420P, width, height, pattern, padding, 0, luma);
+    AVFramePtr nv12Frame = createTestFrame(AV_PIX_FMT_NV12, width, height, pattern, padding, 0, unused);
+    AVFramePtr grayFrame = createTestFrame(AV_PIX_FMT_GRAY8, width, height, pattern, padding, 0, unused);
+    AVFramePtr rgbFrame = createTestFrame(AV_PIX_FMT_RGB24, width, height, pattern, padding, 0, rgbLuma);
+    AVFramePtr highBitDepthFrame = createTestFrame(AV_PIX_FMT_YUV420P10LE, width, height, pattern, padding, 0, highBitDepthLuma);
+    if (!yuvFrame || !nv12Frame || !grayFrame || !rgbFrame || !highBitDepthFrame) {
+        results.check(false, "frame allocation", testCase);
+        return;
+    }
+
+    vector<Grid> grids;
+    CellMedians medians;
+    for (auto& grid : Grids) {
+        if (grid.columns > static_cast<unsigned>(width) || grid.rows > static_cast<unsigned>(height))
+            continue;
+        grids.push_back(grid);
+        string gridCase = testCase + " " + std::to_string(grid.columns) + "x" + std::to_string(grid.rows);
+
+        medians.assign(grid.cellCount(), -1);
+        results.check(analyzeGrayscaleFrame(yuvFrame.get(), grid, nullptr, medians.data()), "medians", gridCase);
+        results.checkMedians("medians", gridCase, medians, referenceCellMedians(luma, width, height, grid));
+
+        checkRowHistogramKernels<0>(results, yuvFrame.get(), grid, gridCase);
+        if (grid.columns == 3)
+            checkRowHistogramKernels<3>(results, yuvFrame.get(), grid, gridCase);
+    }
+
+    medians.assign(referenceCellMedians(luma, width, height, grids).size(), -1);
+    results.check(analyzeGrayscaleFrameWithGrids(yuvFrame.get(), grids, nullptr, medians.data()), "multiple grids", testCase);
+    results.checkMedians("multiple grids", testCase, medians, referenceCellMedians(luma, width, height, grids));
+
+    // Whole keyframes, in each kind of format: with a luma plane, converted, and with more than 8 bits per sample. The
+    // YUV frames aren't tagged with a range, so they're limited range, and gray frames are full range.
+    AnalyzerOptions options;
+    options.grids = grids;
+    AnalysisState analysisState;
+    CellMedians expectedMedians = referenceCellMedians(fullRangeLuma(luma), width, height, grids);
+    for (auto frame : { yuvFrame.get(), nv12Frame.get(), grayFrame.get() }) {
+        string formatCase = testCase + " " + av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format));
+        results.check(analyzeKeyframe(frame, 0, options, analysisState, medians), "direct luma", formatCase);
+        results.checkMedians("direct luma", formatCase, medians, frame == grayFrame.get() ? referenceCellMedians(luma, width, height, grids) : expectedMedians);
+    }
+
+    // swscale's fixed point coefficients can round gray to one code value off its components; a median of values that
+    // are each off by at most one is off by at most one as well.
+    results.check(analyzeKeyframe(rgbFrame.get(), 0, options, analysisState, medians), "converted", testCase + " rgb24");
+    results.checkMedians("converted", testCase + " rgb24", medians, referenceCellMedians(rgbLuma, width, height, grids), 1);
+
+    vector<uint16_t> shiftedLuma(highBitDepthLuma.size());
+    std::transform(highBitDepthLuma.begin(), highBitDepthLuma.end(), shiftedLuma.begin(), [](uint16_t sample) { return sample >> 2; });
+    string highBitDepthCase = testCase + " yuv420p10le";
+    results.check(analyzeKeyframe(highBitDepthFrame.get(), 0, options, analysisState, medians), "shifted luma", highBitDepthCase);
+    results.checkMedians("shifted luma", highBitDepthCase, medians, referenceCellMedians(fullRangeLuma(shiftedLuma), width, height, grids));
+
+    // Keyframe images are full range 8-bit luma too, whatever the range and depth of the luma plane.
+    auto checkImage = [&](const AVFrame* frame, const vector<uint16_t>& expectedLuma) {
+        string formatCase = testCase + " " + av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format));
+        AVFramePtr image = analysisState.grayscaleConverter.expandLuma(frame, hasFullRangeLuma(frame, options));
+        bool matches = image != nullptr;
+        for (int y = 0; y < height && matches; ++y) {
+            for (int x = 0; x < width && matches; ++x)
+                matches = image->data[0][y * image->linesize[0] + x] == expectedLuma[y * width + x];
+        }
+        results.check(matches, "keyframe image", formatCase);
+    };
+    checkImage(yuvFrame.get(), fullRangeLuma(luma));
+    checkImage(grayFrame.get(), luma);
+    checkImage(highBitDepthFrame.get(), fullRangeLuma(shiftedLuma));
+
+    options.lumaScale = LumaScale::Native;
+    CellMedians expectedNativeMedians = referenceCellMedians(highBitDepthLuma, width, height, grids);
+    results.check(analyzeKeyframe(highBitDepthFrame.get(), 0, options, analysisState, medians), "native luma", highBitDepthCase);
+    results.checkMedians("native luma", highBitDepthCase, medians, expectedNativeMedians);
+    results.check(analyzeKeyframe(yuvFrame.get(), 0, options, analysisState, medians), "native luma", testCase + " yuv420p");
+    results.checkMedians("native luma", testCase + " yuv420p", medians, referenceCellMedians(luma, width, height, grids));
+
+    // Untagged frames are limited range, which at 10 bits runs from 64 to 940.
+    options.lumaScale = LumaScale::Normalized;
+    CellMedians expectedNormalizedMedians = expectedNativeMedians;
+    for (auto& median : expectedNormalizedMedians)
+        median = (median - 64) / (940 - 64);
+    results.check(analyzeKeyframe(highBitDepthFrame.get(), 0, options, analysisState, medians), "normalized luma", highBitDepthCase);
+    results.checkMedians("normalized luma", highBitDepthCase, medians, expectedNormalizedMedians);
+    expectedNormalizedMedians = referenceCellMedians(luma, width, height, grids);
+    for (auto& median : expectedNormalizedMedians)
+        median = (median - 16) / (235 - 16);
+    results.check(analyzeKeyframe(yuvFrame.get(), 0, options, analysisState, medians), "normalized luma", testCase + " yuv420p");
+    results.checkMedians("normalized luma", testCase + " yuv420p", medians, expectedNormalizedMedians);
+    options.lumaScale = LumaScale::EightBit;
+
+    if (pattern != TestPattern::Flat)
+        return;
+
+    results.check(coarseLumaMedian(yuvFrame.get()) == luma[0], "coarse median", testCase);
+
+    // The downscaled medians are in the same range as the exact ones: limited range luma is expanded, whether it's
+    // sampled from the luma plane or scaled by swscale, and full range luma isn't.
+    CellMedians expectedGrayMedians = referenceCellMedians(luma, width, height, grids);
+    options.sampleStride = 4;
+    for (auto frame : { yuvFrame.get(), grayFrame.get(), highBitDepthFrame.get() }) {
+        string formatCase = testCase + " " + av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format));
+        results.check(analyzeKeyframe(frame, 0, options, analysisState, medians), "sample stride", formatCase);
+        results.checkMedians("sample stride", formatCase, medians, frame == grayFrame.get() ? expectedGrayMedians : expectedMedians);
+    }
+
+    options.lumaScale = LumaScale::Native;
+    results.check(analyzeKeyframe(highBitDepthFrame.get(), 0, options, analysisState, medians), "native sample stride", highBitDepthCase);
+    results.checkMedians("native sample stride", highBitDepthCase, medians, expectedNativeMedians);
+    options.lumaScale = LumaScale::EightBit;
+
+    options.sampleStride = 1;
+    options.analysisWidth = 32;
+    options.analysisHeight = 18;
+    for (auto frame : { yuvFrame.get(), grayFrame.get() }) {
+        string formatCase = testCase + " " + av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format));
+        results.check(analyzeKeyframe(frame, 0, options, analysisState, medians), "analysis resolution", formatCase);
+        results.checkMedians("analysis resolution", formatCase, medians, frame == grayFrame.get() ? expectedGrayMedians : expectedMedians);
+    }
+
+    // Reduced keyframes are analyzed as full range 8-bit luma, whatever the scale of the medians.
+    options.lumaScale = LumaScale::Normalized;
+    CellMedians expectedReducedMedians = expectedMedians;
+    for (auto& median : expectedReducedMedians)
+        median /= 255;
+    results.check(analyzeKeyframe(yuvFrame.get(), 0, options, analysisState, medians), "normalized analysis resolution", testCase);
+    results.checkMedians("normalized analysis resolution", testCase, medians, expectedReducedMedians);
+}
+
+struct AVOutputFormatContextDeleter {
+    void operator()(AVFormatContext* context)
+    {
+        avio_closep(&context->pb);
+        avformat_free_context(context);
+    }
+};
+using AVOutputFormatContextPtr = std::unique_ptr<AVFormatContext, AVOutputFormatContextDeleter>;
+
+// The clip the self-test analyzes end to end: noise, different in every frame, encoded losslessly with FFV1, so that
+// the analysis of each keyframe must match the reference medians of the frame it was encoded from. The last GOP is
+// shorter than the others.
+static const int TestClipWidth = 160;
+static const int TestClipHeight = 90;
+static const int TestClipFrameCount = 50;
+static const int TestClipGOPSize = 12;
+
+// Sends a frame to the encoder, or drains it if frame is null, and writes the packets it returns to the clip.
+static bool writeTestClipPackets(AVCodecContext* encoder, const AVFrame* frame, AVFormatContext* output)
+{
+    int result = avcodec_send_frame(encoder, frame);
+    AVPacketPtr packet(av_packet_alloc());
+    while (result >= 0) {
+        result = avcodec_receive_packet(encoder, packet.get());
+        if (result == AVERROR(EAGAIN) || result == AVERROR_EOF)
+            return true;
+        if (result < 0)
+            break;
+
+        av_packet_rescale_ts(packet.get(), encoder->time_base, output->streams[0]->time_base);
+        packet->stream_index = 0;
+        result = av_interleaved_write_frame(output, packet.get());
+    }
+
+    logging(LogLevel::Error, "Error: Failed to encode self-test clip: %s", AVError(result));
+    return false;
+}
+
+// Writes the test clip to filename, in Matroska, which indexes its keyframes, so that seeking to them is checked too.
+static bool writeTestClip(const string& filename)
+{
+    AVFormatContext* outputRawPointer = nullptr;
+    int result = avformat_alloc_output_context2(&outputRawPointer, nullptr, "matroska", filename.c_str());
+    AVOutputFormatContextPtr output(outputRawPointer);
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
+    if (result < 0 || !codec) {
+        logging(LogLevel::Error, "Error: Failed to find the FFV1 encoder and Matroska muxer for the self-test clip.");
+        return false;
+    }
+
+    AVCodecContextPtr encoder(avcodec_alloc_context3(codec));
+    if (!encoder) {
+        logging(LogLevel::Error, "Error: Failed to allocate the self-test clip's encoder.");
+        return false;
+    }
+    encoder->width = TestClipWidth;
+    encoder->height = TestClipHeight;
+    encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder->time_base = { 1, 25 };
+    encoder->gop_size = TestClipGOPSize;
+    if (output->oformat->flags & AVFMT_GLOBALHEADER)
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    // The stream's time base is only a hint; the muxer picks its own when the header is written, and the packets are
+    // rescaled to it.
+    AVStream* stream = avformat_new_stream(output.get(), nullptr);
+    if (stream)
+        stream->time_base = encoder->time_base;
+    if (!stream || (result = avcodec_open2(encoder.get(), codec, nullptr)) < 0 || (result = avcodec_parameters_from_context(stream->codecpar, encoder.get())) < 0
+        || (result = avio_open(&output->pb, filename.c_str(), AVIO_FLAG_WRITE)) < 0 || (result = avformat_write_header(output.get(), nullptr)) < 0) {
+        logging(LogLevel::Error, "Error: Failed to start writing self-test clip: %s", AVError(result));
+        return false;
+    }
+
+    vector<uint16_t> luma;
+    for (int i = 0; i < TestClipFrameCount; ++i) {
+        AVFramePtr frame = createTestFrame(AV_PIX_FMT_YUV420P, TestClipWidth, TestClipHeight, TestPattern::Noise, 0, i, luma);
+        if (!frame)
+            return false;
+        frame->pts = i;
+        if (!writeTestClipPackets(encoder.get(), frame.get(), output.get()))
+            return false;
+    }
+
+    if (!writeTestClipPackets(encoder.get(), nullptr, output.get()) || (result = av_write_trailer(output.get())) < 0) {
+        logging(LogLevel::Error, "Error: Failed to finish writing self-test clip: %s", AVError(result));
+        return false;
+    }
+    return true;
+}
+
+// Analyzes the test clip with each of the options that change how keyframes are found, read, decoded, or analyzed, and
+// checks that every one of them finds the same keyframes, with the same timestamps, as reading the clip linearly, and
+// gets their reference medians.
+static void checkClipPaths(SelfTestResults& results)
+{
+    const char* temporaryDirectory = getenv("TMPDIR");
+    string filename = string(temporaryDirectory ? temporaryDirectory : "/tmp") + "/analyze-keyframes-self-test-" + std::to_string(getpid()) + ".mkv";
+    bool clipWritten = writeTestClip(filename);
+    results.check(clipWritten, "clip encoding", filename);
+    if (!clipWritten) {
+        unlink(filename.c_str());
+        return;
+    }
+
+    AnalyzerOptions baseOptions;
+    baseOptions.grids = { { 3, 3 }, { 8, 8 } };
+    vector<CellMedians> expectedMedians;
+    for (int i = 0; i < TestClipFrameCount; i += TestClipGOPSize) {
+        vector<uint16_t> luma;
+        createTestFrame(AV_PIX_FMT_YUV420P, TestClipWidth, TestClipHeight, TestPattern::Noise, 0, i, luma);
+        expectedMedians.push_back(referenceCellMedians(fullRangeLuma(luma), TestClipWidth, TestClipHeight, baseOptions.grids));
+    }
+
+    auto analyzeClip = [&](const AnalyzerOptions& options, vector<KeyframeAnalysis>& keyframes) {
+        return Analyzer(options).analyze(filename.c_str(), [&](const KeyframeAnalysis& keyframe) {
+            keyframes.push_back(keyframe);
+            return true;
+        });
+    };
+
+    vector<KeyframeAnalysis> linearKeyframes;
+    auto checkKeyframes = [&](const char* path, const vector<KeyframeAnalysis>& keyframes) {
+        string testCase = string("the test clip with ") + path;
+        char detail[64];
+        snprintf(detail, sizeof(detail), "%zu keyframes, expected %zu", keyframes.size(), expectedMedians.size());
+        results.check(keyframes.size() == expectedMedians.size(), "keyframe count", testCase, detail);
+        for (size_t i = 0; i < std::min(keyframes.size(), expectedMedians.size()); ++i) {
+            string keyframeCase = testCase + ", keyframe " + std::to_string(i);
+            results.checkMedians("clip analysis", keyframeCase, keyframes[i].cellMedians, expectedMedians[i]);
+            if (i < linearKeyframes.size())
+                results.check(keyframes[i].timestamp == linearKeyframes[i].timestamp, "clip analysis", keyframeCase, "wrong timestamp");
+        }
+    };
+
+    results.check(analyzeClip(baseOptions, linearKeyframes), "linear reading", "the test clip");
+    checkKeyframes("linear reading", linearKeyframes);
+
+    struct Variant {
+        const char* name;
+        std::function<void(AnalyzerOptions&)> configure;
+    };
+    const Variant Variants[] = {
+        { "keyframe seeking", [](AnalyzerOptions& options) { options.seekKeyframes = true; } },
+        { "keyframe-only demuxing", [](AnalyzerOptions& options) { options.demuxKeyframesOnly = true; } },
+        { "single-threaded decoding", [](AnalyzerOptions& options) { options.decodeThreads = 1; } },
+        { "pipeline", [](AnalyzerOptions& options) { options.analysisThreads = 2; } },
+        { "pooled frame buffers", [](AnalyzerOptions& options) {
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+                options.cpus.push_back(cpu);
+        } },
+    };
+    for (auto& variant : Variants) {
+        AnalyzerOptions options = baseOptions;
+        variant.configure(options);
+        vector<KeyframeAnalysis> keyframes;
+        results.check(analyzeClip(options, keyframes), variant.name, "the test clip");
+        checkKeyframes(variant.name, keyframes);
+    }
+
+    // The shards of a sharded analysis must add up to the whole.
+    vector<KeyframeAnalysis> shardedKeyframes;
+    for (unsigned shard = 0; shard < 3; ++shard) {
+        AnalyzerOptions options = baseOptions;
+        options.shardIndex = shard;
+        options.shardCount = 3;
+        results.check(analyzeClip(options, shardedKeyframes), "sharding", "the test clip");
+    }
+    checkKeyframes("sharding", shardedKeyframes);
+
+    // An analysis interrupted after its first row and resumed must write the same rows as one that wasn't interrupted,
+    // and no more keyframes than the maximum in all. Marking every keyframe after the first as a duplicate checks that
+    // the resumed ones are still compared with it.
+    for (bool marksDuplicates : { false, true }) {
+        AnalyzerOptions options = baseOptions;
+        options.resume = true;
+        options.maximumKeyframeCount = 3;
+        if (marksDuplicates) {
+            options.duplicateThreshold = 255;
+            options.duplicateMetric = DuplicateMetric::LInfinity;
+            options.markDuplicates = true;
+        }
+        string testCase = string("the test clip interrupted after one keyframe") + (marksDuplicates ? ", marking duplicates" : "");
+        string outputFilename = filename + ".csv";
+        string uninterruptedRows;
+        results.check(Analyzer(options).analyzeToFile(filename.c_str(), outputFilename.c_str()) && readFile(outputFilename, uninterruptedRows),
+            "resuming", testCase);
+        string resumedRows;
+        bool resumed = writeFile(outputFilename + ".tmp", uninterruptedRows.substr(0, uninterruptedRows.find('\n') + 1))
+            && writeFile(outputFilename + ".tmp.key", resumeKey(options)) && !unlink(outputFilename.c_str())
+            && Analyzer(options).analyzeToFile(filename.c_str(), outputFilename.c_str()) && readFile(outputFilename, resumedRows);
+        size_t rowCount = std::count(resumedRows.begin(), resumedRows.end(), '\n');
+        char detail[64];
+        snprintf(detail, sizeof(detail), "%zu rows, expected %u", rowCount, options.maximumKeyframeCount);
+        results.check(resumed, "resuming", testCase);
+        results.check(rowCount == options.maximumKeyframeCount, "resumed row count", testCase, detail);
+        results.check(resumedRows == uninterruptedRows, "resumed rows", testCase);
+        unlink(outputFilename.c_str());
+    }
+
+    unlink(filename.c_str());
+}
+
+// Checks that once the state a keyframe's processing uses has been allocated, processing more keyframes of the same
+// format allocates nothing more. Only operator new is counted; what FFmpeg allocates with av_malloc() isn't, as it
+// can't be interposed.
+static void checkKeyframeAllocations(SelfTestResults& results)
+{
+    countsAllocations = true;
+    allocationCount = 0;
+    ::operator delete(::operator new(1));
+    countsAllocations = false;
+    if (!allocationCount) {
+        logging(LogLevel::Verbose, "Self-test: Not checking allocations, as this program doesn't count them.");
+        return;
+    }
+
+    AnalyzerOptions options;
+    options.grids = { { 3, 3 }, { 8, 8 } };
+    options.duplicateThreshold = 0;
+    options.markDuplicates = true;
+    AVCodecContextPtr codecContext(avcodec_alloc_context3(nullptr));
+    AnalysisState analysisState;
+    Analyzer::KeyframeHandler handleKeyframe = [](const KeyframeAnalysis&) { return true; };
+    StreamAnalysis streamAnalysis;
+    streamAnalysis.options = &options;
+    streamAnalysis.codecContext = codecContext.get();
+    streamAnalysis.analysisStates = &analysisState;
+    streamAnalysis.handleKeyframe = &handleKeyframe;
+
+    // Each format is analyzed by a different path: straight from the luma plane, converted by swscale, and shifted.
+    for (auto format : { AV_PIX_FMT_YUV420P, AV_PIX_FMT_RGB24, AV_PIX_FMT_YUV420P10LE }) {
+        string testCase = string("854x480 noise ") + av_get_pix_fmt_name(format);
+        vector<uint16_t> luma;
+        AVFramePtr frame = createTestFrame(format, 854, 480, TestPattern::Noise, 0, 0, luma);
+        if (!codecContext || !frame) {
+            results.check(false, "frame allocation", testCase);
+            return;
+        }
+
+        bool processingSucceeded = processKeyframe(streamAnalysis, frame.get());
+        countsAllocations = true;
+        allocationCount = 0;
+        for (int i = 0; i < 4 && processingSucceeded; ++i)
+            processingSucceeded = processKeyframe(streamAnalysis, frame.get());
+        countsAllocations = false;
+
+        char detail[64];
+        snprintf(detail, sizeof(detail), "%" PRIu64 " allocations", allocationCount);
+        results.check(processingSucceeded, "keyframe processing", testCase);
+        results.check(!allocationCount, "keyframe allocations", testCase, detail);
+    }
+}
+
+bool runSelfTests()
+{
+    struct Size {
+        int width;
+        int height;
+    };
+    // A common size, one that doesn't divide evenly into any of the grids, and one with a single pixel per cell of the
+    // largest grid.
+    static const Size Sizes[] = { { 854, 480 }, { 97, 61 }, { 16, 9 } };
+
+    SelfTestResults results;
+    for (auto& size : Sizes) {
+        for (auto pattern : { TestPattern::Flat, TestPattern::Gradient, TestPattern::Noise }) {
+            for (int padding : { 0, 24 })
+                checkFramePaths(results, size.width, size.height, pattern, padding);
+        }
+    }
+    checkKeyframeAllocations(results);
+    checkClipPaths(results);
+
+    logging("Self-test: %u checks, %u failed.", results.checkCount, results.failureCount);
+    return !results.failureCount;
 }
@@ -8,12 +8,33 @@
  *    BSD 3-clause; see LICENSE.
  */
 
+// The keyframe analysis library, libanalyzekeyframes. Create an Analyzer with the options to analyze with, and hand it
+// one input after another; the results are delivered to a callback, pulled from a KeyframeStream, or written to a
+// file, as the analyze-keyframes program does. The other classes here are the building blocks of the analysis.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame-analysis-format.h"
 
 extern "C" {
     #include <libavcodec/avcodec.h>
     #include <libavformat/avformat.h>
+    #include <libavutil/hwcontext.h>
     #include <libavutil/imgutils.h>
+    #include <libavutil/parseutils.h>
+    #include <libavutil/pixdesc.h>
     #include <libswscale/swscale.h>
 }
 
@@ -34,3 +55,551 @@ using AVCodecContextPtr = std::unique_ptr<AVCodecContext, AVCodecContextDeleter>
 struct AVPacketDeleter { void operator()(AVPacket* packet) { av_packet_free(&packet); } };
 using AVPacketPtr = std::unique_ptr<AVPacket, AVPacketDeleter>;
 
+
+// Reads the input through a custom AVIOContext with a large buffer, so the demuxer's many small reads are served from
+// memory, and the underlying file, pipe, or connection is read in large chunks. The input may be a local file, "-" for
+// stdin, or any URL that FFmpeg's protocols support, like https://. Seeks are passed through to the source, so with an
+// HTTP server that supports range requests, seeking between keyframes only fetches the ranges that are read.
+class InputReader {
+public:
+    ~InputReader();
+
+    bool open(const char* input, int bufferSize);
+
+    // The AVIOContext to give the format context. It must not outlive the InputReader.
+    AVIOContext* ioContext() const { return m_ioContext; }
+
+private:
+    static int read(void* opaque, uint8_t* buffer, int size);
+    static int64_t seek(void* opaque, int64_t offset, int whence);
+
+    AVIOContext* m_source { nullptr };
+    AVIOContext* m_ioContext { nullptr };
+};
+
+// Converts decoded frames to GRAY8 for analysis. The scaling context is cached and the output frames are drawn from a
+// small pool, so neither is rebuilt for every keyframe; they're only reallocated when the stream changes resolution or
+// pixel format.
+class GrayscaleConverter {
+public:
+    // Returns a GRAY8 copy of the frame's luma, or nullptr on failure. Once the caller is finished with the returned
+    // frame, it should hand it back with recycleFrame() so its buffer can be reused.
+    AVFramePtr convert(const AVFrame*);
+
+    // Returns a GRAY8 copy of the frame's luma, scaled to the given size with the given swscale algorithm.
+    AVFramePtr convert(const AVFrame*, int width, int height, int scalingFlags);
+
+    // Like convert(), but only scales the frame's luma plane, which keeps its range: limited range luma isn't expanded,
+    // as swscale does when converting YUV frames to GRAY8. Higher bit depths are still reduced to 8 bits. Returns
+    // nullptr if the frame's format has no luma plane that can be scaled on its own.
+    AVFramePtr scaleLuma(const AVFrame*, int width, int height, int scalingFlags);
+
+    // Returns a GRAY8 copy of the frame's luma plane with the full range 8-bit value of each sample, expanding limited
+    // range luma the way swscale does when converting YUV frames to GRAY8. Returns nullptr if the frame's format has no
+    // luma plane that scaleLuma() accepts.
+    AVFramePtr expandLuma(const AVFrame*, bool isFullRange);
+    void recycleFrame(AVFramePtr);
+
+private:
+    AVFramePtr acquireFrame(int width, int height);
+    AVFramePtr scale(const AVFrame*, AVPixelFormat sourceFormat, int width, int height, int scalingFlags);
+
+    SwsContextPtr m_conversionContext;
+    std::vector<AVFramePtr> m_framePool;
+    std::vector<float> m_lumaValues;
+};
+
+// The formats of the files FrameAnalysisWriter writes. The binary format is described in frame-analysis-format.h.
+enum class FrameAnalysisFormat { CSV, Binary };
+
+// Where an interrupted run writing an output file left off; see FrameAnalysisWriter::openResuming().
+struct ResumePoint {
+    // The timestamp of the last row written, or AV_NOPTS_VALUE if there's nothing to resume.
+    int64_t timestamp { AV_NOPTS_VALUE };
+    // The number of rows written, which count towards AnalyzerOptions::maximumKeyframeCount.
+    uint64_t rowCount { 0 };
+    // The medians of the last row not marked as a near-duplicate, which the keyframes after it are compared with.
+    std::vector<float> lastMedians;
+};
+
+// Writes the analysis of each keyframe as a row of a CSV file. The file is opened once, and rows are formatted into a
+// buffer that is written out in large chunks. The file is written under a temporary name and only renamed into place
+// by commit(), so readers never see a partial file; if the writer is destroyed without committing, the temporary file
+// is removed.
+class FrameAnalysisWriter {
+public:
+    ~FrameAnalysisWriter();
+
+    // Opens the output file. The header describes the analyzed stream; the CSV format only uses its time base, while
+    // the binary format writes it, and the grids, at the start of the file. See frame-analysis-format.h.
+    bool open(const char* filename, FrameAnalysisFormat, const FrameAnalysisFileHeader&, const FrameAnalysisFileGrid* grids);
+
+    // Like open(), but if an earlier run writing the same file was interrupted, keeps the rows it wrote, and sets
+    // resumePoint to where it left off. Every row is written out as soon as it's added, so that an interrupted run
+    // loses at most the row it was writing.
+    bool openResuming(const char* filename, FrameAnalysisFormat, const FrameAnalysisFileHeader&, const FrameAnalysisFileGrid* grids, ResumePoint&);
+
+    // Whether each CSV row ends with a column that's 1 for near-duplicate keyframes and 0 otherwise. Must be set before
+    // the file is opened. The binary format has no such column.
+    void setMarksDuplicates(bool marksDuplicates) { m_marksDuplicates = marksDuplicates; }
+
+    // Identifies the options the output is written with. openResuming() only resumes from output written with the same
+    // key, which is kept next to the temporary file until it's committed. Must be set before the file is opened.
+    void setResumeKey(const std::string& resumeKey) { m_resumeKey = resumeKey; }
+
+    // Writes the medians of one keyframe, whose timestamp is in units of the header's time base.
+    bool writeRow(int64_t timestamp, const float* values, unsigned count, bool isDuplicate = false);
+
+    // Writes CSV rows that have already been formatted, like those of another file. Each must end with a newline.
+    bool writeFormattedRows(const std::string& rows);
+
+    // Writes out any buffered rows, syncs the file to disk, and renames it to its final name.
+    bool commit();
+
+private:
+    bool flush();
+    void appendValue(float);
+    void appendRecord(int64_t timestamp, const float* values, unsigned count);
+    bool prepareHeader(const FrameAnalysisFileGrid* grids);
+    bool resumeFrom(const std::string& contents, ResumePoint&);
+    bool writeResumeKey();
+
+    FrameAnalysisFormat m_format { FrameAnalysisFormat::CSV };
+    FrameAnalysisFileHeader m_header { };
+    std::string m_filename;
+    std::string m_temporaryFilename;
+    std::string m_buffer;
+    std::string m_resumeKey;
+    int m_fileDescriptor { -1 };
+    bool m_flushesEveryRow { false };
+    bool m_marksDuplicates { false };
+};
+
+// Writes log lines to stderr on a background thread, so that the threads analyzing keyframes don't wait for stderr,
+// or for each other. Each line is formatted by the thread that logs it, and handed to the logging thread in a slot of
+// a bounded, lock-free ring buffer; the logging thread writes all of the lines that are ready with a single write.
+class AsyncLogger {
+public:
+    static const size_t MaximumLineLength = 2040;
+
+    AsyncLogger();
+
+    // Writes any lines that are still in the buffer. All other threads that log must have finished.
+    ~AsyncLogger();
+
+    // Queues a line, without a newline, to be written. Lines longer than MaximumLineLength are truncated. If the buffer
+    // is full, waits for the logging thread to make room.
+    void log(const char* line, size_t length);
+
+private:
+    static const size_t SlotCount = 512;
+
+    // A slot is ready to be filled by the producer that claims position p when sequence == p, and ready to be written
+    // when sequence == p + 1. See <http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue>.
+    struct Slot {
+        std::atomic<size_t> sequence;
+        uint32_t length;
+        char line[MaximumLineLength];
+    };
+
+    void run();
+
+    std::unique_ptr<Slot[]> m_slots;
+    std::atomic<size_t> m_enqueuePosition { 0 };
+    size_t m_dequeuePosition { 0 };
+    std::atomic<bool> m_stopping { false };
+    std::mutex m_wakeLock;
+    std::condition_variable m_wakeCondition;
+    std::thread m_thread;
+};
+
+// The timed stages of analyzing a file; see PerformanceStatistics.
+enum class Stage { Read, SendPacket, ReceiveFrame, Convert, Analyze, Write };
+static const size_t StageCount = 6;
+
+// Timings and counters for the stages of the analysis, enabled with --stats and summarized at exit. They're updated by
+// every thread analyzing any file, so the counters are atomic and the keyframe latencies are guarded by a lock.
+class PerformanceStatistics {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void addStageTime(Stage stage, Clock::duration duration)
+    {
+        m_stageNanoseconds[static_cast<size_t>(stage)].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(), std::memory_order_relaxed);
+        m_stageCalls[static_cast<size_t>(stage)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void addBytesRead(uint64_t byteCount) { m_bytesRead.fetch_add(byteCount, std::memory_order_relaxed); }
+    void addPacketRead() { m_packetsRead.fetch_add(1, std::memory_order_relaxed); }
+    void addPacketDecoded() { m_packetsDecoded.fetch_add(1, std::memory_order_relaxed); }
+
+    // Records that a keyframe was written, and how long it took from leaving the decoder to being written.
+    void addKeyframe(Clock::duration latency);
+
+    void logSummary() const;
+    bool writeJSON(const char* filename) const;
+
+private:
+    // Returns the given percentile of a sorted copy of the keyframe latencies, in milliseconds.
+    static double latencyPercentile(const std::vector<int64_t>& sortedLatencies, unsigned percentile);
+
+    std::atomic<int64_t> m_stageNanoseconds[StageCount] { };
+    std::atomic<uint64_t> m_stageCalls[StageCount] { };
+    std::atomic<uint64_t> m_bytesRead { 0 };
+    std::atomic<uint64_t> m_packetsRead { 0 };
+    std::atomic<uint64_t> m_packetsDecoded { 0 };
+    Clock::time_point m_startTime { Clock::now() };
+    mutable std::mutex m_latencyLock;
+    std::vector<int64_t> m_keyframeLatencies;
+};
+
+struct QueueStatistics {
+    uint64_t itemCount { 0 };
+    size_t maximumDepth { 0 };
+    // The total time that producers spent waiting for the queue to have room, and that consumers spent waiting for it
+    // to have items. A stage that rarely waits for either is the bottleneck.
+    std::chrono::steady_clock::duration pushWaitTime { };
+    std::chrono::steady_clock::duration popWaitTime { };
+};
+
+// A bounded, blocking queue with any number of producers and consumers, used to connect the stages of the analysis
+// pipeline. push() blocks while the queue is full, so a slow stage holds back the stages feeding it rather than letting
+// decoded frames pile up.
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity)
+        : m_capacity(capacity)
+    {
+    }
+
+    // Returns false if the queue has been closed.
+    bool push(T&& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_items.size() >= m_capacity && !m_closed) {
+            auto waitStart = std::chrono::steady_clock::now();
+            m_notFull.wait(lock, [this] { return m_items.size() < m_capacity || m_closed; });
+            m_statistics.pushWaitTime += std::chrono::steady_clock::now() - waitStart;
+        }
+        if (m_closed)
+            return false;
+
+        m_items.push_back(std::move(item));
+        ++m_statistics.itemCount;
+        m_statistics.maximumDepth = std::max(m_statistics.maximumDepth, m_items.size());
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue has been closed and all of its items have been popped.
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_items.empty() && !m_closed) {
+            auto waitStart = std::chrono::steady_clock::now();
+            m_notEmpty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+            m_statistics.popWaitTime += std::chrono::steady_clock::now() - waitStart;
+        }
+        if (m_items.empty())
+            return false;
+
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    // Called once the producers are finished. Consumers still receive the items remaining in the queue.
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+    // Closes the queue and discards its items, so that the stages on both sides stop as soon as possible.
+    void abort()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_items.clear();
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+    QueueStatistics statistics() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_statistics;
+    }
+
+private:
+    const size_t m_capacity;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    std::deque<T> m_items;
+    bool m_closed { false };
+    QueueStatistics m_statistics;
+};
+
+enum class ImageFormat { PGM, PNG, JPEG };
+
+// Encodes keyframe images and writes them out on a pool of worker threads, so that exporting images doesn't slow down
+// the analysis. Frames are handed over by reference rather than copied. The queue is bounded, so a slow disk holds back
+// the analysis rather than letting frames pile up in memory.
+class ImageExporter {
+public:
+    // If maximumWidth is nonzero, wider frames are scaled down to it, keeping their aspect ratio.
+    ImageExporter(ImageFormat, unsigned maximumWidth, unsigned threadCount, size_t queueDepth);
+
+    // Waits for the queued images to be written.
+    ~ImageExporter();
+
+    // Queues the 8-bit luma plane of the frame, which must be refcounted and full range, to be written to filename,
+    // with the extension for the format appended.
+    bool exportFrame(const AVFrame*, std::string filename);
+
+    // Waits for the queued images to be written, and returns false if any of them failed.
+    bool finish();
+
+private:
+    struct Job {
+        AVFramePtr frame;
+        std::string filename;
+    };
+
+    void run();
+    bool encode(const AVFrame*, AVCodecContextPtr& encoder, std::string& image) const;
+
+    const ImageFormat m_format;
+    const unsigned m_maximumWidth;
+    BoundedQueue<Job> m_queue;
+    std::vector<std::thread> m_workers;
+    std::atomic<unsigned> m_failureCount { 0 };
+};
+
+// The default grid size; see AnalyzerOptions::grids.
+static const unsigned DefaultVerticalCellCount = 3;
+static const unsigned DefaultHorizontalCellCount = 3;
+
+// The default size of InputReader's buffer, which is how much of the input is read at a time.
+static const unsigned DefaultReadBufferSize = 1024 * 1024;
+
+// The grid of cells into which each keyframe is divided.
+struct Grid {
+    unsigned columns;
+    unsigned rows;
+
+    unsigned cellCount() const { return columns * rows; }
+};
+
+// How the distance between the medians of two keyframes is measured: the sum or the maximum of the absolute
+// differences between their cells.
+enum class DuplicateMetric { L1, LInfinity };
+
+// The scale of the medians, and the range of code values that LumaScale::Normalized maps to 0 to 1; see
+// AnalyzerOptions::lumaScale.
+enum class LumaScale { EightBit, Native, Normalized };
+enum class LumaRange { Auto, Full, Limited };
+
+// The options an Analyzer analyzes with.
+struct AnalyzerOptions {
+    // The grids whose cell medians are computed. When there are several, they're all computed from a single pass over
+    // each keyframe, and each keyframe's medians are those of every grid, in order. Defaults to a single grid of
+    // DefaultHorizontalCellCount x DefaultVerticalCellCount.
+    std::vector<Grid> grids;
+    // The format of the files written by Analyzer::analyzeToFile().
+    FrameAnalysisFormat outputFormat { FrameAnalysisFormat::CSV };
+    // The number of threads the decoder may use for frame and slice threading. 0 lets FFmpeg choose.
+    unsigned decodeThreads { std::thread::hardware_concurrency() };
+    // Use the container's index to read only the keyframe packets, seeking past the packets in between.
+    bool seekKeyframes { false };
+    // Ask the demuxer to discard the analyzed stream's non-keyframe packets, as it does the other streams', so that
+    // demuxers that support it, like those for MP4 and Matroska, don't read their payloads at all.
+    bool demuxKeyframesOnly { false };
+    // Downscaled analysis: if sampleStride is greater than 1, medians are computed from every sampleStride-th pixel of
+    // every sampleStride-th row. Otherwise, if analysisWidth is nonzero, keyframes are shrunk to at most
+    // analysisWidth x analysisHeight before their medians are computed. Both trade exactness for speed;
+    // reportSamplingError also computes the exact medians, and logs how far off the downscaled ones were.
+    unsigned sampleStride { 1 };
+    unsigned analysisWidth { 0 };
+    unsigned analysisHeight { 0 };
+    bool reportSamplingError { false };
+    // By default, the medians are 8-bit code values, and frames with more bits per sample are reduced to 8 bits before
+    // they're analyzed. With LumaScale::Native, frames with a 9- to 16-bit luma plane are analyzed at their own bit
+    // depth, from a histogram with a bin for every code value, and the medians are code values at that depth, like 0
+    // to 1023 for 10-bit video. LumaScale::Normalized also scales the medians so that black is 0 and white is 1, for
+    // full or limited range video, as given by lumaRange or by default by each frame. Frames shrunk with analysisWidth
+    // are still analyzed at 8 bits, and their medians scaled to match.
+    LumaScale lumaScale { LumaScale::EightBit };
+    LumaRange lumaRange { LumaRange::Auto };
+    // Near-duplicate suppression. A keyframe is a duplicate if the distance between its medians and those of the last
+    // keyframe that wasn't, by duplicateMetric, is at most duplicateThreshold; it's dropped, or if markDuplicates is
+    // set, delivered with KeyframeAnalysis::isDuplicate set, and written with a final column of 1. Keyframes whose
+    // coarse luma median is within coarseDuplicateThreshold of that of the last keyframe analyzed are dropped before
+    // their medians are computed at all. Negative thresholds turn these off.
+    float duplicateThreshold { -1 };
+    DuplicateMetric duplicateMetric { DuplicateMetric::LInfinity };
+    bool markDuplicates { false };
+    float coarseDuplicateThreshold { -1 };
+    // The range of presentation times of the keyframes to analyze, in AV_TIME_BASE units, and the maximum number of
+    // keyframes to analyze, or 0 for no limit. The end time is exclusive.
+    int64_t startTime { AV_NOPTS_VALUE };
+    int64_t endTime { AV_NOPTS_VALUE };
+    unsigned maximumKeyframeCount { 0 };
+    // Sharding: if shardCount is nonzero, only the keyframes in the shardIndex-th of shardCount contiguous ranges of
+    // presentation times are analyzed, so that one long file can be split between several processes or machines, and
+    // their outputs joined afterward by mergeFrameAnalysisFiles(). The ranges are split at evenly spaced keyframes of
+    // the container's index, or at evenly spaced times if it has none.
+    unsigned shardIndex { 0 };
+    unsigned shardCount { 0 };
+    // The directory of the cache of analyses written by analyzeToFile(), keyed on the input file and the options that
+    // affect the output, or null to not use one.
+    const char* cacheDirectory { nullptr };
+    // Whether analyzeToFile() continues writing output files left behind by an interrupted run, rather than starting
+    // over.
+    bool resume { false };
+    // The index of the stream to analyze, or -1 to pick the best video stream.
+    int streamIndex { -1 };
+    // Whether to cap how much of the input is probed for stream information, and skip logging every stream.
+    bool fastProbe { false };
+    // The size of the buffer the input is read into.
+    unsigned readBufferSize { DefaultReadBufferSize };
+    // The type of hardware device to decode with, like vaapi, cuda, or videotoolbox, or "auto" to use the first one
+    // that works. If no device is available, software decoding is used.
+    const char* hardwareDecoder { nullptr };
+    // The number of threads that analyze decoded keyframes in parallel with demuxing and decoding. 0 does everything on
+    // one thread.
+    unsigned analysisThreads { 0 };
+    // The number of items that each of the queues between pipeline stages, and KeyframeStream's queue, can hold.
+    unsigned queueDepth { 8 };
+    // The CPUs that the threads reading, decoding, and analyzing each input are pinned to, or empty to let the
+    // scheduler place them. While they're pinned, decoded frames are also allocated from pools that the Analyzer keeps
+    // from one input to the next, so that they stay in memory local to those CPUs, like the Analyzer's other buffers.
+    std::vector<unsigned> cpus;
+};
+
+using CellMedians = std::vector<float>;
+
+// The video stream being analyzed.
+struct StreamInfo {
+    int streamIndex;
+    int width;
+    int height;
+    AVRational timeBase;
+    // The name of the decoder, like h264.
+    const char* codecName;
+};
+
+// The analysis of one keyframe: its presentation timestamp, in units of the stream's time base, the number of the
+// frame in decoding order, and the medians of the cells of every grid, in order.
+struct KeyframeAnalysis {
+    int64_t timestamp { AV_NOPTS_VALUE };
+    int keyframeNumber { 0 };
+    bool isDuplicate { false };
+    CellMedians cellMedians;
+};
+
+struct AnalysisState;
+class FrameBufferPool;
+
+// Analyzes the keyframes of inputs with a fixed set of options. An Analyzer keeps the state that can be reused from one
+// input to the next, like its scaling contexts and frame pools, so analyzing many inputs with one Analyzer is cheaper
+// than creating one for each. An Analyzer analyzes one input at a time; to analyze several in parallel, use an Analyzer
+// on each thread.
+class Analyzer {
+public:
+    // Called once the stream to analyze has been found, and before any of its keyframes. Returning false stops the
+    // analysis.
+    using StreamHandler = std::function<bool(const StreamInfo&)>;
+    // Called with each keyframe, in presentation order, on the thread that called analyze(), or with
+    // AnalyzerOptions::analysisThreads, on the pipeline's writing thread. Returning false stops the analysis.
+    using KeyframeHandler = std::function<bool(const KeyframeAnalysis&)>;
+
+    explicit Analyzer(const AnalyzerOptions&);
+    ~Analyzer();
+
+    // Analyzes the input, which may be a local file, "-" for stdin, or a URL; see InputReader. Returns false if the
+    // input can't be analyzed, or if a handler returned false.
+    bool analyze(const char* input, const KeyframeHandler&, const StreamHandler& = nullptr);
+
+    // Like analyze(), but reads the input through the caller's AVIOContext, which must stay open until this returns.
+    // The name is only used in log messages.
+    bool analyze(AVIOContext*, const char* name, const KeyframeHandler&, const StreamHandler& = nullptr);
+
+    // Writes the analysis of the input to outputFile, in AnalyzerOptions::outputFormat, using the result cache and
+    // resuming interrupted output if the options say to. If keyframe images are being exported, their names start with
+    // keyframeImagePrefix, which may include a directory, so that the images of different inputs don't overwrite
+    // each other.
+    bool analyzeToFile(const char* input, const char* outputFile, const std::string& keyframeImagePrefix = std::string());
+
+    const AnalyzerOptions& options() const { return m_options; }
+
+private:
+    using ResumingStreamHandler = std::function<bool(const StreamInfo&, ResumePoint&)>;
+    bool analyzeInput(const char* input, AVIOContext*, const ResumingStreamHandler&, const KeyframeHandler&, const std::string& keyframeImagePrefix);
+
+    AnalyzerOptions m_options;
+    std::unique_ptr<AnalysisState[]> m_analysisStates;
+    std::unique_ptr<FrameBufferPool> m_frameBufferPool;
+};
+
+// Pulls the analyses of an input's keyframes one at a time, like:
+//
+//     KeyframeStream stream(analyzer, "video.mp4");
+//     KeyframeAnalysis keyframe;
+//     while (stream.next(keyframe))
+//         use(keyframe);
+//     if (!stream.succeeded())
+//         return false;
+//
+// The input is analyzed on a background thread, which waits whenever queueDepth keyframes are waiting to be pulled.
+// The Analyzer must not be used for anything else until the stream is destroyed.
+class KeyframeStream {
+public:
+    KeyframeStream(Analyzer&, const char* input);
+
+    // Stops the analysis, if it's still running.
+    ~KeyframeStream();
+
+    // Waits for the next keyframe. Returns false once every keyframe has been pulled, or if the analysis failed.
+    bool next(KeyframeAnalysis&);
+
+    // Whether the analysis finished successfully. Only meaningful once next() has returned false.
+    bool succeeded() const { return m_succeeded; }
+
+private:
+    std::string m_input;
+    BoundedQueue<KeyframeAnalysis> m_queue;
+    std::atomic<bool> m_succeeded { false };
+    std::thread m_thread;
+};
+
+// Messages are logged if they're at or below the log level, which defaults to Info.
+enum class LogLevel { Error, Warning, Info, Verbose };
+
+// The format is checked like printf's.
+void logging(LogLevel, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void logging(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+// Settings shared by every Analyzer in the process. They must be set before any analysis starts, and the objects they
+// point to must outlive all analysis. By default, log lines are written directly to stderr, and neither statistics nor
+// keyframe images are collected.
+void setLogLevel(LogLevel);
+void setAsyncLogger(AsyncLogger*);
+void setPerformanceStatistics(PerformanceStatistics*);
+void setImageExporter(ImageExporter*);
+
+// Times the analysis kernels on synthetic frames, logging the results and writing them to filename as JSON lines.
+bool runBenchmarks(const char* filename);
+
+// Checks every analysis path, including each histogram kernel the CPU supports, against a reference computed by
+// sorting, over synthetic frames and a short synthetic clip, logging any differences. Returns false if there are any.
+bool runSelfTests();
+
+// Joins the outputs of the shards of one file's analysis, given in order, into outputFile. The shards must all be in
+// the same format, and, in the binary format, describe the same stream and grids. See AnalyzerOptions::shardCount.
+bool mergeFrameAnalysisFiles(const char* outputFile, const std::vector<std::string>& shardFiles);
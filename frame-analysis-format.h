@@ -0,0 +1,159 @@
+/*
+ * frame-analysis-format.h
+ *
+ *  Copyright:
+ *    Jon Honeycutt   (2019) <jhoneycutt@gmail.com>
+ *
+ *  License:
+ *    BSD 3-clause; see LICENSE.
+ */
+
+// The layout of the binary frame analysis files written by analyze-keyframes --format binary, and a small reader for
+// them. This header has no dependencies beyond the C++ standard library and POSIX, so consumers can copy it into their
+// own projects.
+//
+// A file is a FrameAnalysisFileHeader, followed by gridCount FrameAnalysisFileGrids, followed by recordCount
+// fixed-size records starting at headerSize bytes into the file. Each record is an int64_t presentation timestamp, in
+// units of the time base, followed by cellCount float medians: the medians of every cell of the first grid, in
+// row-major order, then those of the second grid, and so on. Records are padded to recordSize bytes, a multiple of 8,
+// so every record and timestamp is naturally aligned when the file is mapped.
+//
+// All fields are in the byte order of the machine that wrote the file. A file from a machine with the other byte order
+// is rejected by the reader, because its version doesn't match.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char FrameAnalysisFileMagic[8] = { 'K', 'F', 'A', 'N', 'A', 'L', 'Y', 'S' };
+static const uint32_t FrameAnalysisFileVersion = 1;
+
+struct FrameAnalysisFileHeader {
+    char magic[8];
+    uint32_t version;
+    // The offset of the first record, and the size of each record, in bytes.
+    uint32_t headerSize;
+    uint32_t recordSize;
+    // The total number of cells in all grids, i.e. the number of medians in each record.
+    uint32_t cellCount;
+    uint32_t gridCount;
+    // The time base of the timestamps, in seconds.
+    int32_t timeBaseNumerator;
+    int32_t timeBaseDenominator;
+    // The analyzed video stream: its index in the input file, its size, and its codec's FFmpeg name.
+    uint32_t streamIndex;
+    uint32_t width;
+    uint32_t height;
+    char codecName[32];
+    uint64_t recordCount;
+};
+
+struct FrameAnalysisFileGrid {
+    uint32_t columns;
+    uint32_t rows;
+};
+
+static_assert(sizeof(FrameAnalysisFileHeader) == 88, "FrameAnalysisFileHeader must not have padding");
+
+// The size of the header and grid list, rounded up so records are 8-byte aligned.
+inline uint32_t frameAnalysisFileHeaderSize(uint32_t gridCount)
+{
+    return (sizeof(FrameAnalysisFileHeader) + gridCount * sizeof(FrameAnalysisFileGrid) + 7) & ~7u;
+}
+
+inline uint32_t frameAnalysisFileRecordSize(uint32_t cellCount)
+{
+    return (sizeof(int64_t) + cellCount * sizeof(float) + 7) & ~7u;
+}
+
+// Maps a binary frame analysis file into memory, and gives direct access to its records, like:
+//
+//     FrameAnalysisFile file;
+//     if (!file.open("frame-analysis.kfa"))
+//         return false;
+//     for (uint64_t i = 0; i < file.recordCount(); ++i)
+//         use(file.timestamp(i), file.medians(i), file.header().cellCount);
+class FrameAnalysisFile {
+public:
+    FrameAnalysisFile() = default;
+    FrameAnalysisFile(const FrameAnalysisFile&) = delete;
+    FrameAnalysisFile& operator=(const FrameAnalysisFile&) = delete;
+
+    ~FrameAnalysisFile()
+    {
+        if (m_data)
+            munmap(m_data, m_size);
+    }
+
+    // Returns false if the file can't be mapped, or isn't a complete, valid frame analysis file.
+    bool open(const char* filename)
+    {
+        int fileDescriptor = ::open(filename, O_RDONLY);
+        if (fileDescriptor == -1)
+            return false;
+
+        struct stat fileStatus;
+        if (fstat(fileDescriptor, &fileStatus) || static_cast<size_t>(fileStatus.st_size) < sizeof(FrameAnalysisFileHeader)) {
+            close(fileDescriptor);
+            return false;
+        }
+
+        m_size = fileStatus.st_size;
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+        close(fileDescriptor);
+        if (data == MAP_FAILED)
+            return false;
+        m_data = static_cast<uint8_t*>(data);
+
+        if (!isValid()) {
+            munmap(m_data, m_size);
+            m_data = nullptr;
+            return false;
+        }
+
+        return true;
+    }
+
+    const FrameAnalysisFileHeader& header() const { return *reinterpret_cast<const FrameAnalysisFileHeader*>(m_data); }
+    const FrameAnalysisFileGrid* grids() const { return reinterpret_cast<const FrameAnalysisFileGrid*>(m_data + sizeof(FrameAnalysisFileHeader)); }
+    uint64_t recordCount() const { return header().recordCount; }
+
+    int64_t timestamp(uint64_t record) const { return *reinterpret_cast<const int64_t*>(this->record(record)); }
+    double timestampInSeconds(uint64_t record) const { return static_cast<double>(timestamp(record)) * header().timeBaseNumerator / header().timeBaseDenominator; }
+    const float* medians(uint64_t record) const { return reinterpret_cast<const float*>(this->record(record) + sizeof(int64_t)); }
+
+private:
+    const uint8_t* record(uint64_t record) const { return m_data + header().headerSize + record * header().recordSize; }
+
+    // Checks that the header, grid list and records all fit in the mapping, and are consistent with each other. The
+    // counts are bounded first, so that the sizes computed from them can't overflow.
+    bool isValid() const
+    {
+        auto& fileHeader = header();
+        if (memcmp(fileHeader.magic, FrameAnalysisFileMagic, sizeof(FrameAnalysisFileMagic)) || fileHeader.version != FrameAnalysisFileVersion)
+            return false;
+
+        if (fileHeader.gridCount > (UINT32_MAX - sizeof(FrameAnalysisFileHeader) - 7) / sizeof(FrameAnalysisFileGrid)
+            || fileHeader.cellCount > (UINT32_MAX - sizeof(int64_t) - 7) / sizeof(float))
+            return false;
+
+        if (fileHeader.headerSize != frameAnalysisFileHeaderSize(fileHeader.gridCount) || fileHeader.recordSize != frameAnalysisFileRecordSize(fileHeader.cellCount)
+            || fileHeader.headerSize > m_size || (m_size - fileHeader.headerSize) / fileHeader.recordSize < fileHeader.recordCount)
+            return false;
+
+        uint64_t cellCount = 0;
+        for (uint32_t i = 0; i < fileHeader.gridCount; ++i)
+            cellCount += static_cast<uint64_t>(grids()[i].columns) * grids()[i].rows;
+        return cellCount == fileHeader.cellCount;
+    }
+
+    uint8_t* m_data { nullptr };
+    size_t m_size { 0 };
+};
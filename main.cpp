@@ -0,0 +1,627 @@
+/*
+ * analyze-keyframes:
+ *   A program that uses the libraries provided by ffmpeg to analyze
+ *   keyframes from a video file.
+ *
+ *  Copyright:
+ *    Leandro Moreira (2017) <https://github.com/leandromoreira>
+ *    Jon Honeycutt   (2019) <jhoneycutt@gmail.com>
+ *
+ *  License:
+ *    BSD 3-clause; see LICENSE.
+ */
+
+// The analyze-keyframes command line program, which parses its options into an Analyzer's, and writes the analysis
+// of each input file with it. The analysis itself is in libanalyzekeyframes; see analyze-keyframes.h.
+
+#include "analyze-keyframes.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+
+// The default output file; see Options.
+static const char* FrameAnalysisCSVFile = "frame-analysis.csv";
+static const char* FrameAnalysisBinaryFile = "frame-analysis.kfa";
+
+// The number of threads that encode and write keyframe images, and the number of images that can be waiting for them.
+static const unsigned ImageExportThreadCount = 2;
+static const size_t ImageExportQueueDepth = 16;
+
+// The highest CPU number that can be given to --cpus, so that a mistyped range doesn't have to be listed in full.
+static const unsigned MaximumCPUNumber = 65535;
+
+using std::string;
+using std::vector;
+
+// Options that can be set from the command line: those of the Analyzer, and those of the program itself.
+struct Options : AnalyzerOptions {
+    // The file to write, when not in batch mode. Defaults to FrameAnalysisCSVFile or FrameAnalysisBinaryFile,
+    // depending on the format.
+    const char* outputFile { nullptr };
+    // Outputs each keyframe as an 8bpp grayscale image, named like frame-0.pgm, in the given format, and scaled down to
+    // at most keyframeImageWidth pixels wide if it's nonzero. See ImageExporter.
+    bool outputKeyframeImages { false };
+    ImageFormat keyframeImageFormat { ImageFormat::PGM };
+    unsigned keyframeImageWidth { 0 };
+    // Whether to collect and log PerformanceStatistics, and the file to also write them to as JSON, if any.
+    bool statistics { false };
+    const char* statisticsFile { nullptr };
+    // The number of files analyzed in parallel in batch mode.
+    unsigned jobs { std::max(1u, std::thread::hardware_concurrency()) };
+    // In batch mode, the directory to which each file's analysis is written.
+    string outputDirectory { "." };
+    // Whether to spread the files being analyzed across the NUMA nodes, pinning the threads analyzing each one to its
+    // node's CPUs, or those of them that are in AnalyzerOptions::cpus, if any are given.
+    bool numa { false };
+    // Batch mode is used when more than one input file, or a list of input files, is given.
+    bool batch { false };
+    vector<string> inputFiles;
+};
+
+static bool parseOptions(int argc, const char* argv[], Options&);
+static bool analyzeBatch(const Options&, const vector<vector<unsigned>>& numaNodes);
+static string batchOutputName(const Options&, const string& inputFile);
+static string batchOutputFilename(const Options&, const string& inputFile);
+static AnalyzerOptions workerOptions(const Options&, const vector<vector<unsigned>>& numaNodes, size_t worker);
+static vector<vector<unsigned>> numaNodeCPUs(const vector<unsigned>& allowedCPUs);
+static bool parseCPUList(const char* string, vector<unsigned>& cpus);
+
+int main(int argc, const char* argv[])
+{
+    AsyncLogger logger;
+    setAsyncLogger(&logger);
+
+    avformat_network_init();
+
+    // The benchmarks don't take any input files, so they're run before the rest of the options are parsed.
+    if (argc == 3 && !strcmp(argv[1], "--benchmark"))
+        return runBenchmarks(argv[2]) ? 0 : -1;
+
+    // Nor does the self-test, or merging the outputs of shards.
+    if (argc == 2 && !strcmp(argv[1], "--self-test"))
+        return runSelfTests() ? 0 : -1;
+    if (argc >= 4 && !strcmp(argv[1], "--merge"))
+        return mergeFrameAnalysisFiles(argv[2], vector<string>(argv + 3, argv + argc)) ? 0 : -1;
+
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        logging(LogLevel::Error, "Usage: %s [-q | -v] [--grid COLUMNSxROWS] [--output FILE] [--format csv|binary] [--keyframe-images] [--keyframe-image-format pgm|png|jpeg] [--keyframe-image-width N] [--sample-stride N | --analysis-resolution WxH] [--report-sampling-error] [--luma-scale 8bit|native|normalized] [--luma-range auto|full|limited] [--duplicate-threshold X [--duplicate-metric l1|linf] [--mark-duplicates]] [--coarse-duplicate-threshold X] [--stats] [--stats-json FILE] [--cache-dir DIR] [--resume] [--start TIME] [--end TIME] [--max-keyframes N] [--shard I/N] [--stream N] [--fast-probe] [--read-buffer-size KIB] [--decode-threads N] [--hwaccel TYPE] [--seek-keyframes] [--demux-keyframes-only] [--analysis-threads N] [--queue-depth N] [--jobs N] [--output-dir DIR] [--cpus LIST] [--numa] <video file>... | @<file list>", argv[0]);
+        logging(LogLevel::Error, "       %s --merge OUTPUT SHARD...", argv[0]);
+        logging(LogLevel::Error, "       %s --benchmark RESULTS.json", argv[0]);
+        logging(LogLevel::Error, "       %s --self-test", argv[0]);
+        return -1;
+    }
+
+    PerformanceStatistics statistics;
+    if (options.statistics)
+        setPerformanceStatistics(&statistics);
+
+    std::unique_ptr<ImageExporter> exporter;
+    if (options.outputKeyframeImages) {
+        exporter.reset(new ImageExporter(options.keyframeImageFormat, options.keyframeImageWidth, ImageExportThreadCount, ImageExportQueueDepth));
+        setImageExporter(exporter.get());
+    }
+
+    vector<vector<unsigned>> numaNodes;
+    if (options.numa)
+        numaNodes = numaNodeCPUs(options.cpus);
+
+    bool succeeded;
+    if (options.batch)
+        succeeded = analyzeBatch(options, numaNodes);
+    else
+        succeeded = Analyzer(workerOptions(options, numaNodes, 0)).analyzeToFile(options.inputFiles[0].c_str(), options.outputFile);
+
+    if (exporter && !exporter->finish())
+        succeeded = false;
+
+    if (options.statistics) {
+        statistics.logSummary();
+        if (options.statisticsFile && !statistics.writeJSON(options.statisticsFile))
+            succeeded = false;
+    }
+
+    return succeeded ? 0 : -1;
+}
+
+// Analyzes every input file on a pool of worker threads, each of which analyzes one file after another with its own
+// Analyzer, so that the state it keeps is reused across files. Each file's analysis is written to its own file in the
+// output directory. A failure only affects the file it occurred in; returns false if any of the files failed.
+static bool analyzeBatch(const Options& options, const vector<vector<unsigned>>& numaNodes)
+{
+    // Two workers writing the same output file would overwrite each other's analysis, so refuse to start if any of the
+    // input files would be.
+    std::map<string, const string*> inputFilesByOutputFile;
+    for (auto& inputFile : options.inputFiles) {
+        auto inserted = inputFilesByOutputFile.emplace(batchOutputFilename(options, inputFile), &inputFile);
+        if (!inserted.second) {
+            logging(LogLevel::Error, "Error: The analyses of %s and %s would both be written to %s.", inserted.first->second->c_str(), inputFile.c_str(), inserted.first->first.c_str());
+            return false;
+        }
+    }
+
+    std::atomic<size_t> nextFileIndex { 0 };
+    std::atomic<unsigned> failureCount { 0 };
+
+    auto analyzeFiles = [&](size_t worker) {
+        Analyzer analyzer(workerOptions(options, numaNodes, worker));
+        while (true) {
+            size_t fileIndex = nextFileIndex++;
+            if (fileIndex >= options.inputFiles.size())
+                return;
+
+            auto& inputFile = options.inputFiles[fileIndex];
+            string outputFile = batchOutputFilename(options, inputFile);
+            if (!analyzer.analyzeToFile(inputFile.c_str(), outputFile.c_str(), batchOutputName(options, inputFile) + "-")) {
+                logging(LogLevel::Error, "Error: Failed to analyze %s.", inputFile.c_str());
+                ++failureCount;
+            }
+        }
+    };
+
+    size_t workerCount = std::min<size_t>(options.jobs, options.inputFiles.size());
+    vector<std::thread> workers;
+    for (size_t i = 1; i < workerCount; ++i)
+        workers.emplace_back(analyzeFiles, i);
+    analyzeFiles(0);
+    for (auto& worker : workers)
+        worker.join();
+
+    logging("Analyzed %zu files, %u failed.", options.inputFiles.size(), failureCount.load());
+    return !failureCount;
+}
+
+// In batch mode, the analysis of a file, and its keyframe images, are written to the output directory, named after the
+// input file. Input files with the same name in different directories can't be analyzed in the same batch.
+static string batchOutputName(const Options& options, const string& inputFile)
+{
+    size_t lastSlash = inputFile.find_last_of('/');
+    string basename = lastSlash == string::npos ? inputFile : inputFile.substr(lastSlash + 1);
+    return options.outputDirectory + "/" + basename;
+}
+
+static string batchOutputFilename(const Options& options, const string& inputFile)
+{
+    return batchOutputName(options, inputFile) + (options.outputFormat == FrameAnalysisFormat::Binary ? ".kfa" : ".csv");
+}
+
+// The options a worker analyzes with. With --numa, the workers are spread across the NUMA nodes, round robin, and each
+// one's threads are pinned to its node, so that every keyframe is decoded and analyzed on the same node.
+static AnalyzerOptions workerOptions(const Options& options, const vector<vector<unsigned>>& numaNodes, size_t worker)
+{
+    AnalyzerOptions analyzerOptions = options;
+    if (!numaNodes.empty())
+        analyzerOptions.cpus = numaNodes[worker % numaNodes.size()];
+    return analyzerOptions;
+}
+
+// Returns the CPUs of each NUMA node that has any of the allowed CPUs, or any CPUs at all if none are given, in order
+// of node number. Returns nothing if the nodes can't be determined, which is the case other than on Linux.
+static vector<vector<unsigned>> numaNodeCPUs(const vector<unsigned>& allowedCPUs)
+{
+    std::map<unsigned, vector<unsigned>> nodes;
+    if (DIR* nodeDirectory = opendir("/sys/devices/system/node")) {
+        while (dirent* entry = readdir(nodeDirectory)) {
+            unsigned node;
+            char ignored;
+            if (sscanf(entry->d_name, "node%u%c", &node, &ignored) != 1)
+                continue;
+
+            std::ifstream cpuListFile(string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+            string cpuList;
+            vector<unsigned> cpus;
+            if (!std::getline(cpuListFile, cpuList) || !parseCPUList(cpuList.c_str(), cpus))
+                continue;
+
+            if (!allowedCPUs.empty()) {
+                cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&](unsigned cpu) {
+                    return std::find(allowedCPUs.begin(), allowedCPUs.end(), cpu) == allowedCPUs.end();
+                }), cpus.end());
+            }
+            if (!cpus.empty())
+                nodes[node] = cpus;
+        }
+        closedir(nodeDirectory);
+    }
+
+    if (nodes.empty()) {
+        logging(LogLevel::Warning, "Warning: Failed to find the NUMA nodes' CPUs; threads won't be pinned to nodes.");
+        return { };
+    }
+
+    vector<vector<unsigned>> nodeCPUs;
+    for (auto& node : nodes)
+        nodeCPUs.push_back(std::move(node.second));
+    logging("Spreading analysis across %zu NUMA nodes.", nodeCPUs.size());
+    return nodeCPUs;
+}
+
+
+static bool parseUnsigned(const char* string, unsigned& value)
+{
+    char* end;
+    errno = 0;
+    unsigned long parsedValue = strtoul(string, &end, 10);
+    if (!*string || *end || errno || parsedValue > UINT_MAX || string[0] == '-')
+        return false;
+
+    value = parsedValue;
+    return true;
+}
+
+static bool parseNonnegativeFloat(const char* string, float& value)
+{
+    char* end;
+    errno = 0;
+    float parsedValue = strtof(string, &end);
+    if (!*string || *end || errno || !(parsedValue >= 0))
+        return false;
+
+    value = parsedValue;
+    return true;
+}
+
+// Parses a time given as seconds, like 90.5, or as [HH:]MM:SS[.m...], like 01:00:00, into AV_TIME_BASE units.
+static bool parseTime(const char* string, int64_t& time)
+{
+    return av_parse_time(&time, string, 1) >= 0 && time >= 0;
+}
+
+// Parses a pair of positive dimensions given as <width>x<height>, like 320x180.
+static bool parseDimensions(const char* string, unsigned& width, unsigned& height)
+{
+    auto separator = strchr(string, 'x');
+    if (!separator)
+        return false;
+
+    return parseUnsigned(std::string(string, separator).c_str(), width) && parseUnsigned(separator + 1, height) && width && height;
+}
+
+// Parses a shard given as <index>/<count>, like 2/8, where the index counts from 1, into a 0-based index.
+static bool parseShard(const char* string, unsigned& index, unsigned& count)
+{
+    auto separator = strchr(string, '/');
+    if (!separator)
+        return false;
+
+    if (!parseUnsigned(std::string(string, separator).c_str(), index) || !parseUnsigned(separator + 1, count) || !index || index > count)
+        return false;
+    --index;
+    return true;
+}
+
+// Parses a list of CPU numbers and ranges, like 0-7,16-23, which is also the format of Linux's lists of each NUMA
+// node's CPUs.
+static bool parseCPUList(const char* string, vector<unsigned>& cpus)
+{
+    cpus.clear();
+    const char* position = string;
+    while (true) {
+        char* end;
+        unsigned long first = strtoul(position, &end, 10);
+        if (!isdigit(static_cast<unsigned char>(*position)) || first > MaximumCPUNumber)
+            return false;
+
+        unsigned long last = first;
+        if (*end == '-') {
+            position = end + 1;
+            last = strtoul(position, &end, 10);
+            if (!isdigit(static_cast<unsigned char>(*position)) || last > MaximumCPUNumber || last < first)
+                return false;
+        }
+
+        for (unsigned long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+
+        if (!*end)
+            return true;
+        if (*end != ',')
+            return false;
+        position = end + 1;
+    }
+}
+
+// Parses a grid size given as <columns>x<rows>, like 3x3.
+static bool parseGrid(const char* string, Grid& grid)
+{
+    return parseDimensions(string, grid.columns, grid.rows);
+}
+
+// Reads a list of input files, one per line, from the named file, or from stdin if the name is "-".
+static bool readFileList(const char* filename, vector<string>& inputFiles)
+{
+    std::ifstream listFile;
+    if (strcmp(filename, "-")) {
+        listFile.open(filename);
+        if (!listFile.good()) {
+            logging(LogLevel::Error, "Error: Failed to open file list %s.", filename);
+            return false;
+        }
+    }
+    std::istream& input = strcmp(filename, "-") ? listFile : std::cin;
+
+    string line;
+    while (std::getline(input, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            inputFiles.push_back(line);
+    }
+
+    return true;
+}
+
+static bool parseOptions(int argc, const char* argv[], Options& options)
+{
+    bool hasDecodeThreads = false;
+    for (int i = 1; i < argc; ++i) {
+        const char* argument = argv[i];
+        if (!strcmp(argument, "--grid")) {
+            Grid grid;
+            if (++i == argc || !parseGrid(argv[i], grid)) {
+                logging(LogLevel::Error, "Error: --grid requires a grid size, like 3x3.");
+                return false;
+            }
+            options.grids.push_back(grid);
+        } else if (!strcmp(argument, "--output")) {
+            if (++i == argc) {
+                logging(LogLevel::Error, "Error: --output requires a file name.");
+                return false;
+            }
+            options.outputFile = argv[i];
+        } else if (!strcmp(argument, "--format")) {
+            if (++i < argc && !strcmp(argv[i], "csv"))
+                options.outputFormat = FrameAnalysisFormat::CSV;
+            else if (i < argc && !strcmp(argv[i], "binary"))
+                options.outputFormat = FrameAnalysisFormat::Binary;
+            else {
+                logging(LogLevel::Error, "Error: --format requires csv or binary.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--keyframe-images"))
+            options.outputKeyframeImages = true;
+        else if (!strcmp(argument, "--keyframe-image-format")) {
+            if (++i < argc && !strcmp(argv[i], "pgm"))
+                options.keyframeImageFormat = ImageFormat::PGM;
+            else if (i < argc && !strcmp(argv[i], "png"))
+                options.keyframeImageFormat = ImageFormat::PNG;
+            else if (i < argc && !strcmp(argv[i], "jpeg"))
+                options.keyframeImageFormat = ImageFormat::JPEG;
+            else {
+                logging(LogLevel::Error, "Error: --keyframe-image-format requires pgm, png, or jpeg.");
+                return false;
+            }
+            options.outputKeyframeImages = true;
+        } else if (!strcmp(argument, "--keyframe-image-width")) {
+            if (++i == argc || !parseUnsigned(argv[i], options.keyframeImageWidth) || !options.keyframeImageWidth) {
+                logging(LogLevel::Error, "Error: --keyframe-image-width requires a positive width.");
+                return false;
+            }
+            options.outputKeyframeImages = true;
+        }
+        else if (!strcmp(argument, "--sample-stride")) {
+            if (++i == argc || !parseUnsigned(argv[i], options.sampleStride) || !options.sampleStride) {
+                logging(LogLevel::Error, "Error: --sample-stride requires a positive stride.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--analysis-resolution")) {
+            if (++i == argc || !parseDimensions(argv[i], options.analysisWidth, options.analysisHeight)) {
+                logging(LogLevel::Error, "Error: --analysis-resolution requires a size, like 320x180.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--report-sampling-error"))
+            options.reportSamplingError = true;
+        else if (!strcmp(argument, "--luma-scale")) {
+            if (++i < argc && !strcmp(argv[i], "8bit"))
+                options.lumaScale = LumaScale::EightBit;
+            else if (i < argc && !strcmp(argv[i], "native"))
+                options.lumaScale = LumaScale::Native;
+            else if (i < argc && !strcmp(argv[i], "normalized"))
+                options.lumaScale = LumaScale::Normalized;
+            else {
+                logging(LogLevel::Error, "Error: --luma-scale requires 8bit, native, or normalized.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--luma-range")) {
+            if (++i < argc && !strcmp(argv[i], "auto"))
+                options.lumaRange = LumaRange::Auto;
+            else if (i < argc && !strcmp(argv[i], "full"))
+                options.lumaRange = LumaRange::Full;
+            else if (i < argc && !strcmp(argv[i], "limited"))
+                options.lumaRange = LumaRange::Limited;
+            else {
+                logging(LogLevel::Error, "Error: --luma-range requires auto, full, or limited.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--duplicate-threshold")) {
+            if (++i == argc || !parseNonnegativeFloat(argv[i], options.duplicateThreshold)) {
+                logging(LogLevel::Error, "Error: --duplicate-threshold requires a non-negative distance.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--duplicate-metric")) {
+            if (++i < argc && !strcmp(argv[i], "l1"))
+                options.duplicateMetric = DuplicateMetric::L1;
+            else if (i < argc && !strcmp(argv[i], "linf"))
+                options.duplicateMetric = DuplicateMetric::LInfinity;
+            else {
+                logging(LogLevel::Error, "Error: --duplicate-metric requires l1 or linf.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--mark-duplicates"))
+            options.markDuplicates = true;
+        else if (!strcmp(argument, "--coarse-duplicate-threshold")) {
+            if (++i == argc || !parseNonnegativeFloat(argv[i], options.coarseDuplicateThreshold)) {
+                logging(LogLevel::Error, "Error: --coarse-duplicate-threshold requires a non-negative luma difference.");
+                return false;
+            }
+        } else if (!strcmp(argument, "-q")) {
+            setLogLevel(LogLevel::Warning);
+            av_log_set_level(AV_LOG_ERROR);
+        } else if (!strcmp(argument, "-v")) {
+            setLogLevel(LogLevel::Verbose);
+            av_log_set_level(AV_LOG_VERBOSE);
+        } else if (!strcmp(argument, "--stats"))
+            options.statistics = true;
+        else if (!strcmp(argument, "--stats-json")) {
+            if (++i == argc) {
+                logging(LogLevel::Error, "Error: --stats-json requires a file name.");
+                return false;
+            }
+            options.statistics = true;
+            options.statisticsFile = argv[i];
+        } else if (!strcmp(argument, "--cache-dir")) {
+            if (++i == argc) {
+                logging(LogLevel::Error, "Error: --cache-dir requires a directory.");
+                return false;
+            }
+            options.cacheDirectory = argv[i];
+        } else if (!strcmp(argument, "--resume"))
+            options.resume = true;
+        else if (!strcmp(argument, "--start")) {
+            if (++i == argc || !parseTime(argv[i], options.startTime)) {
+                logging(LogLevel::Error, "Error: --start requires a time, like 90 or 01:30.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--end")) {
+            if (++i == argc || !parseTime(argv[i], options.endTime)) {
+                logging(LogLevel::Error, "Error: --end requires a time, like 90 or 01:30.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--max-keyframes")) {
+            if (++i == argc || !parseUnsigned(argv[i], options.maximumKeyframeCount) || !options.maximumKeyframeCount) {
+                logging(LogLevel::Error, "Error: --max-keyframes requires a positive count.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--shard")) {
+            if (++i == argc || !parseShard(argv[i], options.shardIndex, options.shardCount)) {
+                logging(LogLevel::Error, "Error: --shard requires a shard index and count, like 2/8.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--stream")) {
+            unsigned streamIndex;
+            if (++i == argc || !parseUnsigned(argv[i], streamIndex) || streamIndex > INT_MAX) {
+                logging(LogLevel::Error, "Error: --stream requires a stream index.");
+                return false;
+            }
+            options.streamIndex = streamIndex;
+        } else if (!strcmp(argument, "--fast-probe"))
+            options.fastProbe = true;
+        else if (!strcmp(argument, "--read-buffer-size")) {
+            unsigned kilobytes;
+            if (++i == argc || !parseUnsigned(argv[i], kilobytes) || !kilobytes || kilobytes > INT_MAX / 1024) {
+                logging(LogLevel::Error, "Error: --read-buffer-size requires a size in KiB.");
+                return false;
+            }
+            options.readBufferSize = kilobytes * 1024;
+        } else if (!strcmp(argument, "--decode-threads")) {
+            if (++i == argc || !parseUnsigned(argv[i], options.decodeThreads)) {
+                logging(LogLevel::Error, "Error: --decode-threads requires a thread count.");
+                return false;
+            }
+            hasDecodeThreads = true;
+        } else if (!strcmp(argument, "--seek-keyframes"))
+            options.seekKeyframes = true;
+        else if (!strcmp(argument, "--demux-keyframes-only"))
+            options.demuxKeyframesOnly = true;
+        else if (!strcmp(argument, "--jobs")) {
+            if (++i == argc || !parseUnsigned(argv[i], options.jobs) || !options.jobs) {
+                logging(LogLevel::Error, "Error: --jobs requires a positive job count.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--hwaccel")) {
+            if (++i == argc) {
+                logging(LogLevel::Error, "Error: --hwaccel requires a device type.");
+                return false;
+            }
+            options.hardwareDecoder = argv[i];
+        } else if (!strcmp(argument, "--analysis-threads")) {
+            if (++i == argc || !parseUnsigned(argv[i], options.analysisThreads)) {
+                logging(LogLevel::Error, "Error: --analysis-threads requires a thread count.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--queue-depth")) {
+            if (++i == argc || !parseUnsigned(argv[i], options.queueDepth) || !options.queueDepth) {
+                logging(LogLevel::Error, "Error: --queue-depth requires a positive queue depth.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--output-dir")) {
+            if (++i == argc) {
+                logging(LogLevel::Error, "Error: --output-dir requires a directory.");
+                return false;
+            }
+            options.outputDirectory = argv[i];
+        } else if (!strcmp(argument, "--cpus")) {
+            if (++i == argc || !parseCPUList(argv[i], options.cpus)) {
+                logging(LogLevel::Error, "Error: --cpus requires a list of CPUs, like 0-7,16-23.");
+                return false;
+            }
+        } else if (!strcmp(argument, "--numa"))
+            options.numa = true;
+        else if (argument[0] == '-' && argument[1] == '-') {
+            logging(LogLevel::Error, "Error: Unknown option %s.", argument);
+            return false;
+        } else if (argument[0] == '@') {
+            if (!readFileList(argument + 1, options.inputFiles))
+                return false;
+            options.batch = true;
+        } else
+            options.inputFiles.push_back(argument);
+    }
+
+    if (options.inputFiles.empty())
+        return false;
+
+    if (!options.outputFile)
+        options.outputFile = options.outputFormat == FrameAnalysisFormat::Binary ? FrameAnalysisBinaryFile : FrameAnalysisCSVFile;
+
+    if (options.startTime != AV_NOPTS_VALUE && options.endTime != AV_NOPTS_VALUE && options.endTime <= options.startTime) {
+        logging(LogLevel::Error, "Error: --end must be after --start.");
+        return false;
+    }
+
+    if (options.markDuplicates && options.duplicateThreshold < 0) {
+        logging(LogLevel::Error, "Error: --mark-duplicates requires --duplicate-threshold.");
+        return false;
+    }
+
+    if (options.markDuplicates && options.outputFormat == FrameAnalysisFormat::Binary) {
+        logging(LogLevel::Error, "Error: --mark-duplicates can't be used with --format binary.");
+        return false;
+    }
+
+    if (options.sampleStride > 1 && options.analysisWidth) {
+        logging(LogLevel::Error, "Error: --sample-stride and --analysis-resolution can't be used together.");
+        return false;
+    }
+
+    if (options.inputFiles.size() > 1)
+        options.batch = true;
+
+    if (options.batch && std::find(options.inputFiles.begin(), options.inputFiles.end(), "-") != options.inputFiles.end()) {
+        logging(LogLevel::Error, "Error: stdin can't be analyzed in batch mode.");
+        return false;
+    }
+
+    // When files are analyzed in parallel, split the hardware threads between them, rather than having every file's
+    // decoder use all of them.
+    if (options.batch && !hasDecodeThreads)
+        options.decodeThreads = std::max(1u, std::thread::hardware_concurrency() / options.jobs);
+
+    return true;
+}
+
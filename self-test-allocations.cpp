@@ -0,0 +1,43 @@
+/*
+ * self-test-allocations.cpp
+ *
+ *  Copyright:
+ *    Jon Honeycutt   (2019) <jhoneycutt@gmail.com>
+ *
+ *  License:
+ *    BSD 3-clause; see LICENSE.
+ */
+
+// Replaces the global operator new for analyze-keyframes_test, which the test target builds, so that the self-test can
+// check that analyzing keyframes doesn't allocate; see analyze-keyframes-internal.h. analyze-keyframes itself keeps
+// the standard library's.
+
+#include "analyze-keyframes-internal.h"
+
+#include <cstdlib>
+#include <new>
+
+// Counts the allocations made while countsAllocations is set.
+void* operator new(size_t size)
+{
+    if (countsAllocations)
+        ++allocationCount;
+    if (void* pointer = malloc(size ? size : 1))
+        return pointer;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    free(pointer);
+}